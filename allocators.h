@@ -154,6 +154,73 @@ public:
     }
 };
 
+/**
+ * Allocation of large working buffers backed by huge pages.
+ * MAP_HUGETLB is tried first. If no huge pages are reserved, the fallback is
+ * a region aligned to the huge page size with transparent huge pages
+ * requested by madvise. The pages are faulted in at allocation, so the
+ * first pass over the buffer does not take a page fault for every page.
+ * Memory from AllocateHugePages() must be released with FreeHugePages()
+ * and the same size.
+ */
+static const size_t nHugePageSize = 2 * 1024 * 1024;
+
+static inline size_t GetHugePagesSize(size_t size)
+{
+    return (size + nHugePageSize - 1) / nHugePageSize * nHugePageSize;
+}
+
+static inline void *AllocateHugePages(size_t size)
+{
+    if (!size)
+        return NULL;
+    const size_t alloc_size = GetHugePagesSize(size);
+#ifdef WIN32
+    void *p = VirtualAlloc(NULL, alloc_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    if (p == NULL)
+        p = VirtualAlloc(NULL, alloc_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (p == NULL)
+        return NULL;
+#else
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        // Align the region to a huge page by trimming an oversized mapping
+        char *base = (char *)mmap(NULL, alloc_size + nHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == (char *)MAP_FAILED)
+            return NULL;
+        char *aligned = (char *)((reinterpret_cast<size_t>(base) + nHugePageSize - 1) & ~(nHugePageSize - 1));
+        const size_t head = aligned - base;
+        if (head)
+            munmap(base, head);
+        munmap(aligned + alloc_size, nHugePageSize - head);
+        p = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(p, alloc_size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+    // Fault in the pages
+    const size_t page_size = GetSystemPageSize();
+    for (size_t offset = 0; offset < alloc_size; offset += page_size)
+        static_cast<volatile char *>(p)[offset] = 0;
+    return p;
+}
+
+static inline void FreeHugePages(void *p, size_t size)
+{
+    if (!p)
+        return;
+#ifdef WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, GetHugePagesSize(size));
+#endif
+}
+
 /**
  * Singleton class to keep track of locked (ie, non-swappable) memory pages, for use in
  * std::allocator templates.
@@ -0,0 +1,213 @@
+#include "autotune.h"
+
+CSieveAutoTuner sieveAutoTuner;
+
+// Order of the tunable parameters
+enum
+{
+    TUNE_SIEVE_SIZE = 0,
+    TUNE_SIEVE_FILTER_PRIMES,
+    TUNE_SIEVE_EXTENSIONS,
+    TUNE_L1_CACHE_SIZE,
+    TUNE_TARGET_LENGTH_OFFSET, // sieve for chains this much shorter than the target
+    TUNE_PARAMETERS
+};
+
+CSieveAutoTuner::CSieveAutoTuner()
+{
+    fEnabled = false;
+    params = CSieveParameters();
+    nTargetLength = 0;
+    fConverged = false;
+    nRounds = 0;
+    dSumBlockExpected = 0.0;
+    nSumRoundTime = 0;
+    fBaseline = true;
+    dBestScore = 0.0;
+    nParam = 0;
+    nDirection = 1;
+    nPrevValue = 0;
+    fParamImproved = false;
+    nParamsWithoutGain = 0;
+}
+
+void CSieveAutoTuner::Init()
+{
+    boost::mutex::scoped_lock lock(cs);
+    params.nSieveSize = nSieveSize;
+    params.nSieveFilterPrimes = nSieveFilterPrimes;
+    params.nSieveExtensions = nSieveExtensions;
+    params.nL1CacheSize = nL1CacheSize;
+    params.nSieveTargetLength = nSieveTargetLength;
+    fEnabled = GetBoolArg("-autotune");
+    if (!fEnabled)
+        return;
+
+    // The prime table has been generated for the initial number of filter
+    // primes but covers at least the primes below one million
+    const unsigned int nMaxFilterPrimes = std::min(nMaxSieveFilterPrimes, (unsigned int)vPrimes.size() - 16);
+    const CTunable vDefaults[TUNE_PARAMETERS] = {
+        { "-sievesize", nSieveSize, nMinSieveSize, nMaxSieveSize, 0, 1024, false },
+        { "-sievefilterprimes", nSieveFilterPrimes, nMinSieveFilterPrimes, nMaxFilterPrimes, 0, 1, false },
+        { "-sieveextensions", nSieveExtensions, nMinSieveExtensions, nMaxSieveExtensions, 1, 1, false },
+        { "-l1cachesize", nL1CacheSize, nMinL1CacheSize, nMaxL1CacheSize, 0, 8, false },
+        { "-sievetargetlength", 0, 0, 2, 1, 1, false },
+    };
+    vTunables.assign(vDefaults, vDefaults + TUNE_PARAMETERS);
+
+    // Leave the parameters given on the command line as they are
+    for (unsigned int i = 0; i < TUNE_PARAMETERS; i++)
+        vTunables[i].fFixed = mapArgs.count(vTunables[i].pszName) > 0;
+    printf("CSieveAutoTuner::Init() : tuning the sieve parameters online\n");
+}
+
+void CSieveAutoTuner::BeginRound(CSieveParameters& params)
+{
+    boost::mutex::scoped_lock lock(cs);
+    params = this->params;
+}
+
+void CSieveAutoTuner::FinishRound(unsigned int nRoundSetting, unsigned int nTargetLength, double dRoundBlockExpected, int64 nRoundTime)
+{
+    if (!fEnabled)
+        return;
+    boost::mutex::scoped_lock lock(cs);
+
+    // Start over when the difficulty moves to another chain length
+    if (nTargetLength != this->nTargetLength)
+    {
+        this->nTargetLength = nTargetLength;
+        CTunable& targetLengthOffset = vTunables[TUNE_TARGET_LENGTH_OFFSET];
+        targetLengthOffset.nMax = std::min(2u, std::max(nTargetLength, 1u) - 1);
+        targetLengthOffset.nValue = std::min(targetLengthOffset.nValue, targetLengthOffset.nMax);
+        fConverged = false;
+        fBaseline = true;
+        nParam = 0;
+        nDirection = 1;
+        fParamImproved = false;
+        nParamsWithoutGain = 0;
+        Apply();
+        StartMeasurement();
+        return;
+    }
+
+    // Skip the rounds started with other parameters
+    if (fConverged || nRoundSetting != params.nSetting)
+        return;
+    nRounds++;
+    dSumBlockExpected += dRoundBlockExpected;
+    nSumRoundTime += nRoundTime;
+    if (nRounds < nTuneRounds)
+        return;
+
+    const double dScore = dSumBlockExpected / ((double)std::max(nSumRoundTime, (int64)1) / 1000000.0);
+    if (fDebug && GetBoolArg("-printautotune"))
+        printf("CSieveAutoTuner : %s=%u block/s=%3.12f best=%3.12f\n", fBaseline ? "baseline" : vTunables[nParam].pszName, fBaseline ? 0 : vTunables[nParam].nValue, dScore, dBestScore);
+    if (fBaseline)
+    {
+        // Measured the starting point
+        dBestScore = dScore;
+        fBaseline = false;
+    }
+    else if (dScore > dBestScore)
+    {
+        // Keep the change and continue in the same direction
+        dBestScore = dScore;
+        fParamImproved = true;
+        nParamsWithoutGain = 0;
+    }
+    else
+    {
+        // Undo the change and try the other direction or the next parameter
+        vTunables[nParam].nValue = nPrevValue;
+        if (nDirection > 0 && !fParamImproved)
+            nDirection = -1;
+        else
+        {
+            if (!fParamImproved)
+                nParamsWithoutGain++;
+            nParam = (nParam + 1) % TUNE_PARAMETERS;
+            nDirection = 1;
+            fParamImproved = false;
+        }
+    }
+    NextTrial();
+}
+
+// Write the values to the parameters handed out by BeginRound()
+void CSieveAutoTuner::Apply()
+{
+    params.nSieveSize = vTunables[TUNE_SIEVE_SIZE].nValue;
+    params.nSieveFilterPrimes = vTunables[TUNE_SIEVE_FILTER_PRIMES].nValue;
+    params.nSieveExtensions = vTunables[TUNE_SIEVE_EXTENSIONS].nValue;
+    params.nL1CacheSize = vTunables[TUNE_L1_CACHE_SIZE].nValue;
+    const CTunable& targetLengthOffset = vTunables[TUNE_TARGET_LENGTH_OFFSET];
+    if (!targetLengthOffset.fFixed)
+        params.nSieveTargetLength = (targetLengthOffset.nValue > 0) ? (int)(nTargetLength - targetLengthOffset.nValue) : -1;
+}
+
+// Move a parameter one step in the direction
+// Returns false if the parameter is fixed or already at its limit
+bool CSieveAutoTuner::Step(unsigned int nParam, int nDirection)
+{
+    CTunable& tunable = vTunables[nParam];
+    if (tunable.fFixed)
+        return false;
+    unsigned int nValue = tunable.nValue;
+    if (nDirection > 0)
+    {
+        nValue += tunable.nStep ? tunable.nStep : std::max(nValue / 4, tunable.nAlign);
+        nValue = std::min(nValue, tunable.nMax);
+    }
+    else
+    {
+        const unsigned int nDelta = tunable.nStep ? tunable.nStep : std::max(nValue / 5, tunable.nAlign);
+        nValue = (nValue > tunable.nMin + nDelta) ? nValue - nDelta : tunable.nMin;
+    }
+    nValue = std::max(nValue / tunable.nAlign * tunable.nAlign, tunable.nMin);
+    if (nValue == tunable.nValue)
+        return false;
+    nPrevValue = tunable.nValue;
+    tunable.nValue = nValue;
+    return true;
+}
+
+void CSieveAutoTuner::StartMeasurement()
+{
+    params.nSetting++;
+    nRounds = 0;
+    dSumBlockExpected = 0.0;
+    nSumRoundTime = 0;
+}
+
+// Change a parameter for the next measurement
+void CSieveAutoTuner::NextTrial()
+{
+    while (nParamsWithoutGain < TUNE_PARAMETERS)
+    {
+        if (Step(nParam, nDirection))
+        {
+            Apply();
+            StartMeasurement();
+            return;
+        }
+
+        // At the limit or fixed, try the other direction or the next parameter
+        if (nDirection > 0 && !fParamImproved)
+            nDirection = -1;
+        else
+        {
+            if (!fParamImproved)
+                nParamsWithoutGain++;
+            nParam = (nParam + 1) % TUNE_PARAMETERS;
+            nDirection = 1;
+            fParamImproved = false;
+        }
+    }
+
+    // No single step improves the setting any more
+    fConverged = true;
+    Apply();
+    printf("CSieveAutoTuner : converged for chain length %u with -sievesize=%u -sievefilterprimes=%u -sieveextensions=%u -l1cachesize=%u -sievetargetlength=%d\n",
+        nTargetLength, params.nSieveSize, params.nSieveFilterPrimes, params.nSieveExtensions, params.nL1CacheSize, params.nSieveTargetLength);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "prime.h"
+
+// Online tuning of the sieve parameters (-autotune)
+//
+// The miner threads report the expected number of blocks and the time of
+// every sieve+primality round, the same figures that drive the primorial
+// adjustment. Each setting is measured over a number of rounds from all the
+// threads and the tuner climbs one parameter at a time, keeping a change only
+// if it improves the expected blocks per second. Parameters given on the
+// command line are left alone. Tuning starts over whenever the target chain
+// length changes.
+class CSieveAutoTuner
+{
+public:
+    CSieveAutoTuner();
+
+    // Set up the tunable parameters, called after GeneratePrimeTable()
+    void Init();
+
+    // Get the sieve parameters for a round that is about to start
+    // The parameters are copied together with the id of their setting, so a
+    // round never mixes values of two settings
+    void BeginRound(CSieveParameters& params);
+
+    // Report a completed round measured with the setting from BeginRound()
+    void FinishRound(unsigned int nRoundSetting, unsigned int nTargetLength, double dRoundBlockExpected, int64 nRoundTime);
+
+private:
+    struct CTunable
+    {
+        const char *pszName;
+        unsigned int nValue;
+        unsigned int nMin;
+        unsigned int nMax;
+        unsigned int nStep; // additive step or 0 for steps of 25%
+        unsigned int nAlign; // values are rounded down to a multiple of this
+        bool fFixed; // given on the command line
+    };
+
+    static const unsigned int nTuneRounds = 40; // rounds measured for each setting
+
+    boost::mutex cs;
+    bool fEnabled;
+    std::vector<CTunable> vTunables;
+    CSieveParameters params; // handed out by BeginRound(), nSetting is incremented whenever they change
+    unsigned int nTargetLength; // target length being tuned for
+    bool fConverged;
+
+    // Measurement of the current setting
+    unsigned int nRounds;
+    double dSumBlockExpected;
+    int64 nSumRoundTime;
+
+    // Climbing state
+    bool fBaseline; // measuring the current best values
+    double dBestScore; // expected blocks per second of the best values
+    unsigned int nParam; // parameter being climbed
+    int nDirection; // direction of the climb
+    unsigned int nPrevValue; // value of the parameter before the trial
+    bool fParamImproved; // the parameter improved in this direction
+    unsigned int nParamsWithoutGain; // parameters tried in a row without gain
+
+    void Apply();
+    bool Step(unsigned int nParam, int nDirection);
+    void StartMeasurement();
+    void NextTrial();
+};
+
+extern CSieveAutoTuner sieveAutoTuner;
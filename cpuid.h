@@ -8,20 +8,22 @@ typedef unsigned __int32  uint32_t;
 #else
 #include <stdint.h>
 #endif
+#include <stdio.h>
+#include <string.h>
 
 class CPUID {
   uint32_t regs[4];
 
 public:
-  void load(unsigned i) {
+  void load(unsigned i, unsigned j = 0) {
 #ifdef _WIN32
-    __cpuid((int *)regs, (int)i);
+    __cpuidex((int *)regs, (int)i, (int)j);
 
 #else
     asm volatile
       ("cpuid" : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
-       : "a" (i), "c" (0));
-    // ECX is set to zero for CPUID function 4
+       : "a" (i), "c" (j));
+    // ECX selects the cache for CPUID functions 4 and 0x8000001D
 #endif
   }
 
@@ -29,6 +31,145 @@ public:
   const uint32_t &EBX() const {return regs[1];}
   const uint32_t &ECX() const {return regs[2];}
   const uint32_t &EDX() const {return regs[3];}
+
+  // Extended control register 0: register states saved by the OS
+  static uint64_t XCR0() {
+#ifdef _WIN32
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    asm volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+  }
+
+  // AVX2 support, including the OS support for the YMM registers
+  static bool HasAVX2() {
+    CPUID cpuid;
+    cpuid.load(0);
+    if (cpuid.EAX() < 7)
+      return false;
+    cpuid.load(1);
+    // OSXSAVE and AVX
+    if ((cpuid.ECX() & (1u << 27)) == 0 || (cpuid.ECX() & (1u << 28)) == 0)
+      return false;
+    if ((XCR0() & 0x6) != 0x6)
+      return false;
+    cpuid.load(7);
+    return (cpuid.EBX() & (1u << 5)) != 0;
+  }
+
+  // AVX-512 Foundation support, including the OS support for the ZMM registers
+  static bool HasAVX512F() {
+    if (!HasAVX2())
+      return false;
+    if ((XCR0() & 0xe6) != 0xe6)
+      return false;
+    CPUID cpuid;
+    cpuid.load(7);
+    return (cpuid.EBX() & (1u << 16)) != 0;
+  }
+
+  // Data cache sizes in bytes by level (index 1 is the L1 data cache) and
+  // the number of logical processors sharing each cache, zero if unknown
+  struct CacheTopology {
+    uint32_t size[4];
+    uint32_t sharing[4];
+  };
+
+  static bool GetCacheTopology(CacheTopology &topology) {
+    memset(&topology, 0, sizeof(topology));
+    CPUID cpuid;
+    cpuid.load(0);
+    const uint32_t nMaxLeaf = cpuid.EAX();
+    const bool fIntel = (cpuid.EBX() == 0x756e6547); // "Genu"ineIntel
+    cpuid.load(0x80000000);
+    const uint32_t nMaxExtLeaf = cpuid.EAX();
+    uint32_t nLeaf = 0;
+    if (fIntel && nMaxLeaf >= 4)
+      nLeaf = 4;
+    else if (nMaxExtLeaf >= 0x8000001D) {
+      // AMD topology extensions use the same layout in function 0x8000001D
+      cpuid.load(0x80000001);
+      if (cpuid.ECX() & (1u << 22))
+        nLeaf = 0x8000001D;
+    }
+    for (uint32_t i = 0; nLeaf != 0 && i < 16; i++) {
+      cpuid.load(nLeaf, i);
+      const uint32_t nType = cpuid.EAX() & 0x1f;
+      if (nType == 0)
+        break;
+      const uint32_t nLevel = (cpuid.EAX() >> 5) & 0x7;
+      // Data and unified caches only
+      if ((nType != 1 && nType != 3) || nLevel == 0 || nLevel > 3)
+        continue;
+      const uint32_t nWays = (cpuid.EBX() >> 22) + 1;
+      const uint32_t nPartitions = ((cpuid.EBX() >> 12) & 0x3ff) + 1;
+      const uint32_t nLineSize = (cpuid.EBX() & 0xfff) + 1;
+      const uint32_t nSets = cpuid.ECX() + 1;
+      topology.size[nLevel] = nWays * nPartitions * nLineSize * nSets;
+      topology.sharing[nLevel] = ((cpuid.EAX() >> 14) & 0xfff) + 1;
+    }
+    if (topology.size[1] == 0)
+      GetCacheTopologySysfs(topology);
+    return topology.size[1] != 0;
+  }
+
+private:
+  // Fallback for processors and hypervisors that do not report the caches
+  static void GetCacheTopologySysfs(CacheTopology &topology) {
+#ifdef __linux__
+    for (unsigned int nIndex = 0; nIndex < 16; nIndex++) {
+      char szPath[128];
+      char szType[32] = "";
+      char szShared[256] = "";
+      unsigned int nLevel = 0, nSize = 0;
+      char chUnit = 0;
+      snprintf(szPath, sizeof(szPath), "/sys/devices/system/cpu/cpu0/cache/index%u/level", nIndex);
+      if (!ReadSysfs(szPath, "%u", &nLevel))
+        break;
+      snprintf(szPath, sizeof(szPath), "/sys/devices/system/cpu/cpu0/cache/index%u/type", nIndex);
+      ReadSysfs(szPath, "%31s", szType);
+      if (nLevel == 0 || nLevel > 3 || strcmp(szType, "Instruction") == 0)
+        continue;
+      snprintf(szPath, sizeof(szPath), "/sys/devices/system/cpu/cpu0/cache/index%u/size", nIndex);
+      if (!ReadSysfs(szPath, "%u%c", &nSize, &chUnit))
+        continue;
+      if (chUnit == 'K')
+        nSize *= 1024;
+      else if (chUnit == 'M')
+        nSize *= 1024 * 1024;
+      topology.size[nLevel] = nSize;
+      // The CPU list looks like "0-1,8-9"
+      snprintf(szPath, sizeof(szPath), "/sys/devices/system/cpu/cpu0/cache/index%u/shared_cpu_list", nIndex);
+      ReadSysfs(szPath, "%255s", szShared);
+      uint32_t nSharing = 0;
+      for (const char *psz = szShared; *psz; ) {
+        unsigned int nFirst = 0, nLast = 0;
+        int nChars = 0;
+        if (sscanf(psz, "%u-%u%n", &nFirst, &nLast, &nChars) == 2)
+          nSharing += nLast - nFirst + 1;
+        else if (sscanf(psz, "%u%n", &nFirst, &nChars) == 1)
+          nSharing++;
+        else
+          break;
+        psz += nChars;
+        if (*psz == ',')
+          psz++;
+      }
+      topology.sharing[nLevel] = nSharing ? nSharing : 1;
+    }
+#endif
+  }
+
+  static bool ReadSysfs(const char *pszPath, const char *pszFormat, void *pArg1, void *pArg2 = NULL) {
+    FILE *file = fopen(pszPath, "r");
+    if (file == NULL)
+      return false;
+    const int nFields = pArg2 ? fscanf(file, pszFormat, pArg1, pArg2) : fscanf(file, pszFormat, pArg1);
+    fclose(file);
+    return nFields >= 1;
+  }
 };
 
 #endif // CPUID_H
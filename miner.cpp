@@ -1,4 +1,6 @@
 #include "prime.h"
+#include "autotune.h"
+#include "numa.h"
 #include "protocol.h"
 #include "sha.h"
 #include "workmanager.h"
@@ -60,11 +62,82 @@ bool FUpdateNonce(WorkInfo &winfo, unsigned nMiningProtocol, unsigned nHashFacto
 	return (winfo.block.nNonce < 0xffff0000);
 }
 
+// Primecoin: Sieve groups shared by the miner threads
+static std::vector<std::unique_ptr<CSieveGroup> > vSieveGroups;
+static CCriticalSection csSieveGroups;
+
+static CSieveGroup &GetSieveGroup(unsigned nGroup)
+{
+	LOCK(csSieveGroups);
+	while (vSieveGroups.size() <= nGroup)
+		vSieveGroups.push_back(std::unique_ptr<CSieveGroup>(new CSieveGroup()));
+	return *vSieveGroups[nGroup];
+}
+
+// Primecoin: Retire the sieve of a group when its leader stops mining
+class CSieveGroupLeader
+{
+public:
+	CSieveGroupLeader(CSieveGroup *pgroup) : m_pgroup(pgroup) {}
+	~CSieveGroupLeader()
+		{
+		if (m_pgroup != NULL)
+			m_pgroup->Retire();
+		}
+
+private:
+	CSieveGroup *m_pgroup;
+};
+
+// Primecoin: Weave and test the sieves published by the leader of the group
+static void SieveGroupMiner(CSieveGroup &group)
+{
+	CPrimalityTestParams testParams;
+	unsigned int nGeneration = 0;
+
+	loop
+		{
+		std::unique_ptr<WorkInfo> spwinfo;
+		nGeneration = group.Join(nGeneration, spwinfo);
+		try
+			{
+			while (MineProbablePrimeChainGroup(group, nGeneration, *spwinfo, testParams))
+				{
+				SetThreadPriority(THREAD_PRIORITY_NORMAL);
+				nTotalBlocksFound++;
+				SubmitAndCheckWork(*group.GetLeader(), *spwinfo);
+				SetThreadPriority(THREAD_PRIORITY_LOWEST);
+				}
+			}
+		catch (...)
+			{
+			group.Leave();
+			throw;
+			}
+		group.Leave();
+		}
+}
+
 void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 {
+	// Primecoin: Threads of a sieve group share the sieve of the first thread
+	CSieveGroup *pgroup = NULL;
+	if (nSieveThreads > 1)
+		{
+		pgroup = &GetSieveGroup(workmanager.Thread() / nSieveThreads);
+		if (workmanager.Thread() % nSieveThreads != 0)
+			{
+			SieveGroupMiner(*pgroup);
+			return;
+			}
+		}
+	CSieveGroupLeader groupLeader(pgroup);
+
 	// Primecoin: Allocate data structures for mining
     static CCriticalSection cs;
-    CSieveOfEratosthenes sieve;
+    CSieveOfEratosthenes sieveThread;
+    CSieveOfEratosthenes &sieve = (pgroup != NULL) ? pgroup->sieve : sieveThread;
+    sieve.SetNumaNode(GetThreadNumaNode(workmanager.Thread()));
     CPrimalityTestParams testParams;
     int nAdjustPrimorial = 1; // increase or decrease primorial factor
 
@@ -109,6 +182,7 @@ void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 		unsigned int nRoundTests = 0;
 		unsigned int nRoundPrimesHit = 0;
 		int64 nPrimeTimerStart = GetTimeMicros();
+		sieveAutoTuner.BeginRound(testParams.sieveParams);
 		Primorial(nPrimorialMultiplier, mpzPrimorial);
 
 		loop
@@ -149,7 +223,7 @@ void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 			}
 
 			// Primecoin: mine for prime chain
-			if (MineProbablePrimeChain(workmanager, winfo, vChainsFound, sieve, testParams))
+			if (MineProbablePrimeChain(workmanager, winfo, vChainsFound, sieve, testParams, pgroup))
 			{
 				SetThreadPriority(THREAD_PRIORITY_NORMAL);
 				nTotalBlocksFound++;
@@ -229,12 +303,12 @@ void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 				unsigned int nTargetLength = TargetGetLength(winfo.block.nBits);
 				unsigned int nRequestedLength = nTargetLength;
 				// Override target length if requested
-				if (nSieveTargetLength > 0)
-					nRequestedLength = nSieveTargetLength;
+				if (testParams.sieveParams.nSieveTargetLength > 0)
+					nRequestedLength = testParams.sieveParams.nSieveTargetLength;
 				// Calculate expected number of chains for requested length
 				for (unsigned int n = 0; n < nRequestedLength; n++)
 				{
-					double dPrimeProbability = EstimateCandidatePrimeProbability(nPrimorialMultiplier, n, nMiningProtocol);
+					double dPrimeProbability = EstimateCandidatePrimeProbability(nPrimorialMultiplier, n, nRequestedLength, nMiningProtocol, testParams.sieveParams);
 					dTimeExpected /= dPrimeProbability;
 					dRoundChainExpected *= dPrimeProbability;
 				}
@@ -243,17 +317,19 @@ void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 				double dRoundBlockExpected = dRoundChainExpected;
 				for (unsigned int n = nRequestedLength; n < nTargetLength; n++)
 				{
-					double dPrimeProbability = EstimateNormalPrimeProbability(nPrimorialMultiplier, n, nMiningProtocol);
+					double dPrimeProbability = EstimateNormalPrimeProbability(nPrimorialMultiplier, n, nMiningProtocol, testParams.sieveParams);
 					dTimeExpected /= dPrimeProbability;
 					dRoundBlockExpected *= dPrimeProbability;
 				}
 				// Calculate the effect of fractional difficulty
 				double dFractionalDiff = GetPrimeDifficulty(winfo.block.nBits) - nTargetLength;
-				double dExtraPrimeProbability = EstimateNormalPrimeProbability(nPrimorialMultiplier, nTargetLength, nMiningProtocol);
+				double dExtraPrimeProbability = EstimateNormalPrimeProbability(nPrimorialMultiplier, nTargetLength, nMiningProtocol, testParams.sieveParams);
 				double dDifficultyFactor = ((1.0 - dFractionalDiff) * (1.0 - dExtraPrimeProbability) + dExtraPrimeProbability);
 				dRoundBlockExpected *= dDifficultyFactor;
 				dTimeExpected /= dDifficultyFactor;
 				dBlockExpected += dRoundBlockExpected;
+				// Report the round to the sieve autotuner
+				sieveAutoTuner.FinishRound(testParams.sieveParams.nSetting, nTargetLength, dRoundBlockExpected, nRoundTime);
 				// Calculate the sum of expected blocks and time
                 dSumBlockExpected += dRoundBlockExpected;
                 nSumRoundTime += nRoundTime;
@@ -283,6 +359,7 @@ void LocalBitcoinMiner(ThreadWorkManager &workmanager)
 
 				// Primecoin: reset sieve+primality round timer
 				nPrimeTimerStart = GetTimeMicros();
+				sieveAutoTuner.BeginRound(testParams.sieveParams);
 				nRoundTests = 0;
 				nRoundPrimesHit = 0;
 
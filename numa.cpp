@@ -0,0 +1,120 @@
+#include "numa.h"
+#include "prime.h"
+#include <fstream>
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Processors of each node
+static std::vector<std::vector<unsigned int> > vNodeCpus;
+// Node of each miner thread
+static std::vector<unsigned int> vThreadNodes;
+
+#ifdef __linux__
+// Parse a processor list such as "0-7,16-23"
+static bool ParseCpuList(const std::string& strList, std::vector<unsigned int>& vCpus)
+{
+    std::vector<std::string> vRanges;
+    boost::split(vRanges, strList, boost::is_any_of(","));
+    BOOST_FOREACH(std::string strRange, vRanges)
+    {
+        boost::trim(strRange);
+        if (strRange.empty())
+            continue;
+        unsigned int nFirst = 0, nLast = 0;
+        const int nFields = sscanf(strRange.c_str(), "%u-%u", &nFirst, &nLast);
+        if (nFields < 1)
+            return false;
+        if (nFields == 1)
+            nLast = nFirst;
+        for (unsigned int nCpu = nFirst; nCpu <= nLast && nCpu < CPU_SETSIZE; nCpu++)
+            vCpus.push_back(nCpu);
+    }
+    return true;
+}
+
+static void FindNumaNodes()
+{
+    for (unsigned int nNode = 0; ; nNode++)
+    {
+        std::ifstream file(strprintf("/sys/devices/system/node/node%u/cpulist", nNode).c_str());
+        if (!file.is_open())
+            break;
+        std::string strList;
+        std::getline(file, strList);
+        std::vector<unsigned int> vCpus;
+        if (!ParseCpuList(strList, vCpus))
+            break;
+        // Nodes without processors only have memory
+        if (!vCpus.empty())
+            vNodeCpus.push_back(vCpus);
+    }
+}
+#endif
+
+void InitNuma(unsigned int nThreads)
+{
+    vNodeCpus.clear();
+    vThreadNodes.assign(nThreads, 0);
+#ifdef __linux__
+    if (GetBoolArg("-numa", true))
+        FindNumaNodes();
+#endif
+    if (vNodeCpus.size() < 2)
+    {
+        vNodeCpus.clear();
+        return;
+    }
+
+    // Give each node a share of the sieve groups proportional to its
+    // processors, the threads of a group are numbered consecutively
+    unsigned int nCpus = 0;
+    BOOST_FOREACH(const std::vector<unsigned int>& vCpus, vNodeCpus)
+        nCpus += vCpus.size();
+    const unsigned int nGroupThreads = std::max(1u, nSieveThreads);
+    const unsigned int nGroups = (nThreads + nGroupThreads - 1) / nGroupThreads;
+    unsigned int nNode = 0;
+    unsigned int nNodeCpusEnd = vNodeCpus[0].size();
+    for (unsigned int nGroup = 0; nGroup < nGroups; nGroup++)
+    {
+        // Processor position of the middle of the group
+        const unsigned int nPosition = (unsigned int)(((uint64)nGroup * 2 + 1) * nCpus / (nGroups * 2));
+        while (nPosition >= nNodeCpusEnd && nNode + 1 < vNodeCpus.size())
+            nNodeCpusEnd += vNodeCpus[++nNode].size();
+        for (unsigned int nThread = nGroup * nGroupThreads; nThread < std::min(nThreads, (nGroup + 1) * nGroupThreads); nThread++)
+            vThreadNodes[nThread] = nNode;
+    }
+    printf("NUMA: %u nodes with %u processors\n", (unsigned int)vNodeCpus.size(), nCpus);
+}
+
+unsigned int GetNumaNodeCount()
+{
+    return std::max((size_t)1, vNodeCpus.size());
+}
+
+unsigned int GetThreadNumaNode(unsigned int nThread)
+{
+    return (nThread < vThreadNodes.size()) ? vThreadNodes[nThread] : 0;
+}
+
+bool BindThreadToNumaNode(unsigned int nNode)
+{
+    if (nNode >= vNodeCpus.size())
+        return false;
+#ifdef __linux__
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    BOOST_FOREACH(unsigned int nCpu, vNodeCpus[nNode])
+        CPU_SET(nCpu, &cpuset);
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0)
+    {
+        printf("BindThreadToNumaNode(): failed to bind to node %u\n", nNode);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+// NUMA placement of the miner threads (-numa)
+//
+// The miner threads are spread over the NUMA nodes in contiguous blocks sized
+// by the number of processors of each node, so the threads of a sieve group
+// end up on the same node. Every thread binds itself to the processors of its
+// node before it allocates the sieve and the primality test state, which are
+// then first touched and placed in the memory of that node. Without several
+// nodes, or with -numa=0, nothing is bound and everything is on node 0.
+
+// Find the nodes and assign the miner threads to them
+void InitNuma(unsigned int nThreads);
+
+// Number of nodes the miner threads are spread over
+unsigned int GetNumaNodeCount();
+
+// Node of a miner thread
+unsigned int GetThreadNumaNode(unsigned int nThread);
+
+// Bind the calling thread to the processors of a node
+bool BindThreadToNumaNode(unsigned int nNode);
@@ -3,8 +3,13 @@
 // see the accompanying file COPYING
 
 #include "prime.h"
+#include "autotune.h"
+#include "cpuid.h"
+#include "numa.h"
 #include "protocol.h"
+#include "sievekernels.h"
 #include <climits>
+#include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
 
 /**********************/
@@ -13,12 +18,167 @@
 
 // Prime Table
 std::vector<unsigned int> vPrimes;
+CPrimeConstants primeConstants;
 unsigned int nSieveSize = nDefaultSieveSize;
 unsigned int nSieveFilterPrimes = nDefaultSieveFilterPrimes;
 unsigned int nSieveExtensions = nDefaultSieveExtensions;
 unsigned int nL1CacheSize = nDefaultL1CacheSize;
+unsigned int nL2CacheSize = 0;
+unsigned int nSieveThreads = nDefaultSieveThreads;
+bool fSieveInterleave = false;
+bool fSieveHugePages = false;
+bool fSieveCompactMultipliers = false;
+bool fSieveLayerPrimesAuto = false;
+std::vector<unsigned int> vSieveLayerPrimes;
+
+// Periodic bit patterns of the primes smaller than a sieve word
+// Bit j of vPrimeTiles[nPrimeSeq * nTileWordBits + r] is set if
+// (r + j) % vPrimes[nPrimeSeq] == 0
+static const unsigned int nTileWordBits = 8 * sizeof(sieve_word_t);
+static std::vector<sieve_word_t> vPrimeTiles;
+static unsigned int nTilePrimes = 0;
+
+static void GeneratePrimeTiles()
+{
+    nTilePrimes = 0;
+    while (vPrimes[nTilePrimes] < nTileWordBits)
+        nTilePrimes++;
+    vPrimeTiles.assign(nTilePrimes * nTileWordBits, 0);
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < nTilePrimes; nPrimeSeq++)
+    {
+        const unsigned int nPrime = vPrimes[nPrimeSeq];
+        for (unsigned int r = 0; r < nPrime; r++)
+            for (unsigned int j = (nPrime - r) % nPrime; j < nTileWordBits; j += nPrime)
+                vPrimeTiles[nPrimeSeq * nTileWordBits + r] |= (sieve_word_t)1 << j;
+    }
+}
+
+static void GeneratePrimeConstants()
+{
+    CPrimeConstants& constants = primeConstants;
+    constants.vReciprocals.resize(vPrimes.size());
+    constants.vRotateBits.resize(vPrimes.size());
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < vPrimes.size(); nPrimeSeq++)
+    {
+        const unsigned int nPrime = vPrimes[nPrimeSeq];
+        constants.vReciprocals[nPrimeSeq] = (unsigned int)(((uint64)1 << 32) / nPrime);
+        constants.vRotateBits[nPrimeSeq] = nPrime % nTileWordBits;
+    }
+
+    // Group the primes so that a number is reduced modulo a group with a
+    // single Barrett reduction per 32-bit digit. Prime 2 is never sieved.
+    constants.vGroupStart.clear();
+    constants.vGroupProducts.clear();
+    constants.vGroupReciprocals.clear();
+    unsigned int nPrimeSeq = 1;
+    while (nPrimeSeq < vPrimes.size())
+    {
+        unsigned int nProduct = 1;
+        constants.vGroupStart.push_back(nPrimeSeq);
+        while (nPrimeSeq < vPrimes.size() && nProduct < UINT_MAX / vPrimes[nPrimeSeq])
+        {
+            nProduct *= vPrimes[nPrimeSeq];
+            nPrimeSeq++;
+        }
+        constants.vGroupProducts.push_back(nProduct);
+        constants.vGroupReciprocals.push_back(~(uint64)0 / nProduct);
+    }
+    constants.vGroupStart.push_back(nPrimeSeq);
+}
+
+// Reduce a number modulo the primes [1, nPrimes)
+//   vResidues[i] = mpzN mod vPrimes[i]
+static void ReducePrimeGroups(const mpz_class& mpzN, unsigned int nPrimes, unsigned int *vResidues, const std::vector<unsigned int>& vPrimes, const CPrimeConstants& constants)
+{
+    // Split the number into 32-bit digits, most significant first
+    const size_t nMaxDigits = (mpz_sizeinbase(mpzN.get_mpz_t(), 2) + 31) / 32;
+    std::vector<unsigned int> vDigits(nMaxDigits);
+    size_t nDigits = 0;
+    mpz_export(&vDigits[0], &nDigits, 1, sizeof(unsigned int), 0, 0, mpzN.get_mpz_t());
+
+    for (unsigned int nGroup = 0; constants.vGroupStart[nGroup] < nPrimes; nGroup++)
+    {
+        const uint64 nProduct = constants.vGroupProducts[nGroup];
+#ifdef __SIZEOF_INT128__
+        const uint64 nReciprocal = constants.vGroupReciprocals[nGroup];
+#endif
+        uint64 nRemainder = 0;
+        for (size_t i = 0; i < nDigits; i++)
+        {
+            const uint64 nDividend = (nRemainder << 32) | vDigits[i];
+#ifdef __SIZEOF_INT128__
+            // The estimated quotient is at most one too small
+            const uint64 nQuotient = (uint64)(((unsigned __int128)nDividend * nReciprocal) >> 64);
+            nRemainder = nDividend - nQuotient * nProduct;
+            if (nRemainder >= nProduct)
+                nRemainder -= nProduct;
+#else
+            nRemainder = nDividend % nProduct;
+#endif
+        }
+        const unsigned int nGroupRemainder = (unsigned int)nRemainder;
+        const unsigned int nEnd = std::min(constants.vGroupStart[nGroup + 1], nPrimes);
+        for (unsigned int nPrimeSeq = constants.vGroupStart[nGroup]; nPrimeSeq < nEnd; nPrimeSeq++)
+        {
+            const unsigned int nPrime = vPrimes[nPrimeSeq];
+            vResidues[nPrimeSeq] = nGroupRemainder - DivideByPrime(nGroupRemainder, nPrime, constants.vReciprocals[nPrimeSeq]) * nPrime;
+        }
+    }
+}
+
+// Copies of the prime tables on each NUMA node
+struct CNodePrimeTables
+{
+    std::vector<unsigned int> vPrimes;
+    CPrimeConstants constants;
+};
+static std::vector<CNodePrimeTables*> vNodePrimeTables;
+static boost::mutex csNodePrimeTables;
+
+void GetNodePrimeTables(unsigned int nNode, const std::vector<unsigned int>*& pvPrimes, const CPrimeConstants*& pConstants)
+{
+    pvPrimes = &vPrimes;
+    pConstants = &primeConstants;
+    if (GetNumaNodeCount() < 2)
+        return;
+
+    // The calling thread is bound to the node so the pages of the copy are
+    // first touched and placed there. The copies are never freed.
+    boost::mutex::scoped_lock lock(csNodePrimeTables);
+    if (vNodePrimeTables.size() <= nNode)
+        vNodePrimeTables.resize(nNode + 1, NULL);
+    if (vNodePrimeTables[nNode] == NULL)
+    {
+        CNodePrimeTables *pTables = new CNodePrimeTables();
+        pTables->vPrimes = vPrimes;
+        pTables->constants = primeConstants;
+        vNodePrimeTables[nNode] = pTables;
+    }
+    pvPrimes = &vNodePrimeTables[nNode]->vPrimes;
+    pConstants = &vNodePrimeTables[nNode]->constants;
+}
 
-static unsigned int int_invert(unsigned int a, unsigned int nPrime);
+// Size the sieve chunks and segments from the data caches of the processor
+static void GetDefaultCacheSizes(unsigned int& nDefaultL1, unsigned int& nDefaultL2)
+{
+    CPUID::CacheTopology topology;
+    if (!CPUID::GetCacheTopology(topology))
+    {
+        printf("GetDefaultCacheSizes() : cache sizes not available, using %u\n", nDefaultL1CacheSize);
+        nDefaultL1 = nDefaultL1CacheSize;
+        nDefaultL2 = 0;
+        return;
+    }
+    printf("GetDefaultCacheSizes() : L1D %u KB shared by %u, L2 %u KB shared by %u, L3 %u KB shared by %u\n",
+        topology.size[1] / 1024, topology.sharing[1], topology.size[2] / 1024, topology.sharing[2], topology.size[3] / 1024, topology.sharing[3]);
+    // Leave room for the stack and the prime tables, the same share as the
+    // old default of 28672 bytes for a 32 KB cache. Chunks are not split
+    // between SMT siblings, the per-chunk overhead costs more than the
+    // extra L1 misses.
+    nDefaultL1 = topology.size[1] / 8 * 7;
+    // The L2 cache is shared by the threads of a core or a module
+    nDefaultL2 = topology.size[2] / std::max(topology.sharing[2], 1u);
+}
 
 void GeneratePrimeTable()
 {
@@ -29,12 +189,38 @@ void GeneratePrimeTable()
     nSieveSize = std::max(std::min(nSieveSize, nMaxSieveSize), nMinSieveSize);
     nSieveFilterPrimes = (unsigned int)GetArg("-sievefilterprimes", nDefaultSieveFilterPrimes);
     nSieveFilterPrimes = std::max(std::min(nSieveFilterPrimes, nMaxSieveFilterPrimes), nMinSieveFilterPrimes);
-    nL1CacheSize = (unsigned int)GetArg("-l1cachesize", nDefaultL1CacheSize);
+    unsigned int nDefaultL1, nDefaultL2;
+    GetDefaultCacheSizes(nDefaultL1, nDefaultL2);
+    nL1CacheSize = (unsigned int)GetArg("-l1cachesize", nDefaultL1);
     nL1CacheSize = std::max(std::min(nL1CacheSize, nMaxL1CacheSize), nMinL1CacheSize);
     nL1CacheSize = nL1CacheSize / 8 * 8; // make it a multiple of 8
-    printf("GeneratePrimeTable() : setting nSieveExtensions = %u, nSieveSize = %u, nSieveFilterPrimes = %u, nL1CacheSize = %u\n", nSieveExtensions, nSieveSize, nSieveFilterPrimes, nL1CacheSize);
-
-    const unsigned nPrimeTableLimit = 1000000u;
+    nL2CacheSize = (unsigned int)GetArg("-l2cachesize", nDefaultL2);
+    nSieveThreads = (unsigned int)GetArg("-sievethreads", nDefaultSieveThreads);
+    nSieveThreads = std::max(std::min(nSieveThreads, nMaxSieveThreads), nMinSieveThreads);
+    fSieveInterleave = GetBoolArg("-sieveinterleave");
+    fSieveHugePages = GetBoolArg("-hugepages");
+    fSieveCompactMultipliers = GetBoolArg("-sievecompact");
+    // Primes of each layer: "auto" or a comma separated list of prime counts,
+    // the last count is used for the rest of the layers
+    const std::string strLayerPrimes = GetArg("-sievelayerprimes", "");
+    fSieveLayerPrimesAuto = (strLayerPrimes == "auto");
+    vSieveLayerPrimes.clear();
+    if (!fSieveLayerPrimesAuto && !strLayerPrimes.empty())
+    {
+        std::vector<std::string> vstrLayerPrimes;
+        boost::split(vstrLayerPrimes, strLayerPrimes, boost::is_any_of(","));
+        BOOST_FOREACH(const std::string& strPrimes, vstrLayerPrimes)
+            vSieveLayerPrimes.push_back(std::max(atoi(strPrimes), (int)nMinSieveFilterPrimes));
+    }
+    if (fSieveLayerPrimesAuto || !vSieveLayerPrimes.empty())
+        printf("GeneratePrimeTable() : setting -sievelayerprimes=%s\n", strLayerPrimes.c_str());
+    printf("GeneratePrimeTable() : setting nSieveExtensions = %u, nSieveSize = %u, nSieveFilterPrimes = %u, nL1CacheSize = %u, nL2CacheSize = %u, nSieveThreads = %u, fSieveInterleave = %d, fSieveHugePages = %d, fSieveCompactMultipliers = %d\n", nSieveExtensions, nSieveSize, nSieveFilterPrimes, nL1CacheSize, nL2CacheSize, nSieveThreads, fSieveInterleave, fSieveHugePages, fSieveCompactMultipliers);
+
+    // The table has to cover the filter primes and the primes combined with
+    // them in CSieveOfEratosthenes::WeaveMultipliers(). The n-th prime is
+    // below n * (ln n + ln ln n) for n >= 6.
+    const double dTablePrimes = nSieveFilterPrimes + 16;
+    const unsigned int nPrimeTableLimit = std::max(1000000u, (unsigned int)(dTablePrimes * (log(dTablePrimes) + log(log(dTablePrimes)))) + 1);
     vPrimes.clear();
     // Generate prime table using sieve of Eratosthenes
     std::vector<bool> vfComposite (nPrimeTableLimit, false);
@@ -49,6 +235,8 @@ void GeneratePrimeTable()
         if (!vfComposite[n])
             vPrimes.push_back(n);
     printf("GeneratePrimeTable() : prime table [1, %u] generated with %u primes\n", nPrimeTableLimit, (unsigned int) vPrimes.size());
+    GeneratePrimeTiles();
+    GeneratePrimeConstants();
 }
 
 // Mining statistics
@@ -75,7 +263,9 @@ void InitPrimeMiner()
     nSieveTargetLength = std::min((int)GetArg("-sievetargetlength", nDefaultSieveTargetLength), (int)nMaxChainLength);
     if (nSieveTargetLength > 0)
         printf("InitPrimeMiner() : Setting sieve target length to %d\n", nSieveTargetLength);
+    SelectSieveKernels();
 	GeneratePrimeTable();
+    sieveAutoTuner.Init();
 }
 
 void PrintMinerStatistics()
@@ -810,10 +1000,12 @@ bool ProbablePrimalityTestWithTrialDivision(const mpz_class& mpzCandidate, unsig
     return (FermatProbablePrimalityTestFast(mpzCandidate, nLength, testParams, true));
 }
 
-static void SieveDebugChecks(unsigned int nBits, unsigned int nTriedMultiplier, unsigned int nCandidateType, mpz_class& mpzHash, mpz_class& mpzFixedMultiplier, mpz_class& mpzChainOrigin)
+static void SieveDebugChecks(CSieveOfEratosthenes& sieve, uint64 nTriedMultiplier, unsigned int nCandidateType, mpz_class& mpzHash, mpz_class& mpzFixedMultiplier, mpz_class& mpzChainOrigin)
 {
     // Debugging code to verify the sieve output
-    const unsigned int nTargetLength = TargetGetLength(nBits);
+    // Every chain position is checked against the primes its layer was
+    // weaved with
+    const unsigned int nTargetLength = sieve.GetChainLength();
     mpz_class mpzChainN;
     mpz_class mpzChainNMod;
     if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1 || nCandidateType == PRIME_CHAIN_BI_TWIN)
@@ -825,13 +1017,14 @@ static void SieveDebugChecks(unsigned int nBits, unsigned int nTriedMultiplier,
         {
             mpzChainN = mpzChainOrigin << nChainPosition;
             mpzChainN--;
-            for (unsigned int nPrimeSeq = 0; nPrimeSeq < nSieveFilterPrimes; nPrimeSeq++)
+            const unsigned int nLayerPrimes = sieve.GetLayerPrimes(nTriedMultiplier, nChainPosition);
+            for (unsigned int nPrimeSeq = 0; nPrimeSeq < nLayerPrimes; nPrimeSeq++)
             {
                 if (mpz_divisible_ui_p(mpzChainN.get_mpz_t(), vPrimes[nPrimeSeq]) > 0)
                 {
                     std::string strHash = mpzHash.get_str();
                     std::string strFixedMultiplier = mpzFixedMultiplier.get_str();
-                    printf("SIEVE BUG: %s * %s * %u * 2^%u - 1 is divisible by %u!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier, nChainPosition, vPrimes[nPrimeSeq]);
+                    printf("SIEVE BUG: %s * %s * %"PRI64u" * 2^%u - 1 is divisible by %u!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier, nChainPosition, vPrimes[nPrimeSeq]);
                 }
             }
         }
@@ -845,13 +1038,14 @@ static void SieveDebugChecks(unsigned int nBits, unsigned int nTriedMultiplier,
         {
             mpzChainN = mpzChainOrigin << nChainPosition;
             mpzChainN++;
-            for (unsigned int nPrimeSeq = 0; nPrimeSeq < nSieveFilterPrimes; nPrimeSeq++)
+            const unsigned int nLayerPrimes = sieve.GetLayerPrimes(nTriedMultiplier, nChainPosition);
+            for (unsigned int nPrimeSeq = 0; nPrimeSeq < nLayerPrimes; nPrimeSeq++)
             {
                 if (mpz_divisible_ui_p(mpzChainN.get_mpz_t(), vPrimes[nPrimeSeq]) > 0)
                 {
                     std::string strHash = mpzHash.get_str();
                     std::string strFixedMultiplier = mpzFixedMultiplier.get_str();
-                    printf("SIEVE BUG: %s * %s * %u * 2^%u + 1 is divisible by %u!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier, nChainPosition, vPrimes[nPrimeSeq]);
+                    printf("SIEVE BUG: %s * %s * %"PRI64u" * 2^%u + 1 is divisible by %u!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier, nChainPosition, vPrimes[nPrimeSeq]);
                 }
             }
         }
@@ -860,12 +1054,12 @@ static void SieveDebugChecks(unsigned int nBits, unsigned int nTriedMultiplier,
     {
         std::string strHash = mpzHash.get_str();
         std::string strFixedMultiplier = mpzFixedMultiplier.get_str();
-        printf("SIEVE BUG: %s * %s * %u has unknown type!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier);
+        printf("SIEVE BUG: %s * %s * %"PRI64u" has unknown type!\n", strHash.c_str(), strFixedMultiplier.c_str(), nTriedMultiplier);
     }
 }
 
 // Mine probable prime chain of form: n = h * p# +/- 1
-bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength], CSieveOfEratosthenes& sieve, CPrimalityTestParams& testParams)
+bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength], CSieveOfEratosthenes& sieve, CPrimalityTestParams& testParams, CSieveGroup *pgroup)
 {
     winfo.nTests = 0;
     winfo.nPrimesHit = 0;
@@ -876,26 +1070,38 @@ bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, uns
     unsigned int& nCandidateType = testParams.nCandidateType;
     mpz_class& mpzHashFixedMult = testParams.mpzHashFixedMult;
     mpz_class& mpzChainOrigin = testParams.mpzChainOrigin;
+    std::vector<CSieveCandidate>& vCandidates = testParams.vCandidates;
+    unsigned int& nCandidateNext = testParams.nCandidateNext;
     nBits = winfo.block.nBits;
 
     if (winfo.fNewBlock)
     {
         // Must rebuild the sieve
-        sieve.Deplete();
+        if (pgroup)
+            pgroup->Deplete();
+        else
+            sieve.Deplete();
     }
     winfo.fNewBlock = false;
 
     int64 nStart = 0; // microsecond timer
-    if (!sieve.IsReady() || sieve.IsDepleted())
+    if (!sieve.IsReady() || (pgroup ? pgroup->IsDepleted() : sieve.IsDepleted()))
     {
         // Build sieve
         if (fDebug && GetBoolArg("-printmining"))
             nStart = GetTimeMicros();
-        sieve.Reset(nSieveSize, nSieveFilterPrimes, nSieveExtensions, nL1CacheSize, nBits, winfo.mpzHash, winfo.mpzFixedMultiplier);
-        sieve.Weave(workmanager);
+        if (pgroup)
+            pgroup->Retire();
+        sieve.Reset(testParams.sieveParams, nL2CacheSize, nBits, winfo.mpzHash, winfo.mpzFixedMultiplier);
+        testParams.vCandidates.clear();
+        testParams.nCandidateNext = 0;
+        if (pgroup)
+            pgroup->Weave(workmanager, winfo);
+        else
+            sieve.WeaveMultipliers(workmanager);
         if (fDebug && GetBoolArg("-printmining"))
-            printf("MineProbablePrimeChain() : new sieve (%u/%u@%u%%) ready in %uus\n", sieve.GetCandidateCount(), nSieveSize, sieve.GetProgressPercentage(), (unsigned int) (GetTimeMicros() - nStart));
-        return false; // sieve generation takes time so return now
+            printf("MineProbablePrimeChain() : new sieve (%u primes) ready for weaving in %uus\n", testParams.sieveParams.nSieveFilterPrimes, (unsigned int) (GetTimeMicros() - nStart));
+        return false; // segments are weaved while testing the candidates
     }
 
     if (fDebug && GetBoolArg("-printmining2"))
@@ -908,22 +1114,39 @@ bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, uns
     // Process a part of the candidates
     while (winfo.nTests < nTestsAtOnce && !workmanager.FNewWork())
     {
-        unsigned int nTriedMultiplier = 0;
-        if (!sieve.GetNextCandidateMultiplier(nTriedMultiplier, nCandidateType))
+        if (nCandidateNext >= vCandidates.size())
         {
+            // Drain the next part of the sieve
+            nCandidateNext = 0;
+            if (pgroup ? pgroup->GetNextCandidates(vCandidates) : sieve.GetNextCandidates(vCandidates))
+                continue;
+            if (!(pgroup ? pgroup->IsDepleted() : sieve.IsDepleted()))
+            {
+                // Weave the next segment unless the followers have already
+                // claimed all of them
+                if (!sieve.WeaveNextSegment(&workmanager))
+                    boost::this_thread::yield();
+                continue;
+            }
+
             // power tests completed for the sieve
+            if (pgroup)
+                pgroup->HarvestStatistics(winfo, vChainsFound);
             if (fDebug && GetBoolArg("-printmining2"))
                 printf("MineProbablePrimeChain() : %u tests (%u primes) in %uus\n", winfo.nTests, winfo.nPrimesHit, (unsigned int) (GetTimeMicros() - nStart));
             winfo.fNewBlock = true; // notify caller to change nonce
             return false;
         }
+        const uint64 nTriedMultiplier = vCandidates[nCandidateNext].nMultiplier;
+        nCandidateType = vCandidates[nCandidateNext].nCandidateType;
+        nCandidateNext++;
         winfo.nTests++;
-        mpzChainOrigin = mpzHashFixedMult * nTriedMultiplier;
+        mpz_mul_uint64(mpzChainOrigin, mpzHashFixedMult, nTriedMultiplier);
         bool fChainFound = ProbablePrimeChainTestFast(mpzChainOrigin, testParams);
         unsigned int nChainPrimeLength = TargetGetLength(nChainLength);
 
         if (fDebug && GetBoolArg("-debugsieve"))
-            SieveDebugChecks(nBits, nTriedMultiplier, nCandidateType, winfo.mpzHash, winfo.mpzFixedMultiplier, mpzChainOrigin);
+            SieveDebugChecks(sieve, nTriedMultiplier, nCandidateType, winfo.mpzHash, winfo.mpzFixedMultiplier, mpzChainOrigin);
 
         // Collect mining statistics
         if(nChainPrimeLength >= 1)
@@ -935,166 +1158,490 @@ bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, uns
         // Check if a chain was found
         if (fChainFound)
         {
-            mpz_class mpzPrimeChainMultiplier = winfo.mpzFixedMultiplier * nTriedMultiplier;
+            mpz_class mpzPrimeChainMultiplier;
+            mpz_mul_uint64(mpzPrimeChainMultiplier, winfo.mpzFixedMultiplier, nTriedMultiplier);
             CBigNum bnPrimeChainMultiplier;
             bnPrimeChainMultiplier.SetHex(mpzPrimeChainMultiplier.get_str(16));
             winfo.bnPrimeChainMultiplier = bnPrimeChainMultiplier;
-            printf("nTriedMultiplier = %u\n", nTriedMultiplier); // Debugging
+            printf("nTriedMultiplier = %"PRI64u"\n", nTriedMultiplier); // Debugging
             return true;
         }
     }
     
+    if (pgroup)
+        pgroup->HarvestStatistics(winfo, vChainsFound);
     if (fDebug && GetBoolArg("-printmining2"))
         printf("MineProbablePrimeChain() : %u tests (%u primes) in %uus\n", winfo.nTests, winfo.nPrimesHit, (unsigned int) (GetTimeMicros() - nStart));
     
     return false; // stop as new block arrived
 }
 
-// Get progress percentage of the sieve
-unsigned int CSieveOfEratosthenes::GetProgressPercentage()
+// Weave and test the sieve published by the leader of a sieve group
+bool MineProbablePrimeChainGroup(CSieveGroup& group, unsigned int nGeneration, WorkInfo& winfo, CPrimalityTestParams& testParams)
 {
-    return std::min(100u, (((nPrimeSeq >= vPrimes.size())? nSieveSize : vPrimes[nPrimeSeq]) * 100 / nSieveSize));
-}
+    CSieveOfEratosthenes& sieve = group.sieve;
 
-static unsigned int int_invert(unsigned int a, unsigned int nPrime)
-{
-    // Extended Euclidean algorithm to calculate the inverse of a in finite field defined by nPrime
-    int rem0 = nPrime, rem1 = a % nPrime, rem2;
-    int aux0 = 0, aux1 = 1, aux2;
-    int quotient, inverse;
+    // References to test parameters
+    unsigned int& nBits = testParams.nBits;
+    unsigned int& nChainLength = testParams.nChainLength;
+    unsigned int& nCandidateType = testParams.nCandidateType;
+    mpz_class& mpzHashFixedMult = testParams.mpzHashFixedMult;
+    mpz_class& mpzChainOrigin = testParams.mpzChainOrigin;
+    std::vector<CSieveCandidate>& vCandidates = testParams.vCandidates;
+    unsigned int& nCandidateNext = testParams.nCandidateNext;
+    nBits = winfo.block.nBits;
 
-    while (1)
+    mpzHashFixedMult = winfo.mpzHash * winfo.mpzFixedMultiplier;
+    while (group.IsCurrent(nGeneration))
     {
-        if (rem1 <= 1)
+        boost::this_thread::interruption_point();
+        if (nCandidateNext >= vCandidates.size())
         {
-            inverse = aux1;
-            break;
+            // Drain the next part of the shared sieve
+            nCandidateNext = 0;
+            if (group.GetNextCandidates(vCandidates))
+                continue;
+            if (group.IsDepleted())
+                return false; // power tests completed for the sieve
+
+            // Weave the next segment or wait for the other members
+            if (!sieve.WeaveNextSegment(NULL))
+                boost::this_thread::yield();
+            continue;
         }
+        const uint64 nTriedMultiplier = vCandidates[nCandidateNext].nMultiplier;
+        nCandidateType = vCandidates[nCandidateNext].nCandidateType;
+        nCandidateNext++;
+        mpz_mul_uint64(mpzChainOrigin, mpzHashFixedMult, nTriedMultiplier);
+        bool fChainFound = ProbablePrimeChainTestFast(mpzChainOrigin, testParams);
+        unsigned int nChainPrimeLength = TargetGetLength(nChainLength);
+
+        if (fDebug && GetBoolArg("-debugsieve"))
+            SieveDebugChecks(sieve, nTriedMultiplier, nCandidateType, winfo.mpzHash, winfo.mpzFixedMultiplier, mpzChainOrigin);
 
-        rem2 = rem0 % rem1;
-        quotient = rem0 / rem1;
-        aux2 = -quotient * aux1 + aux0;
+        // Collect mining statistics for the leader
+        group.AddStatistics(1, (nChainPrimeLength >= 1)? 1 : 0, nChainPrimeLength);
 
-        if (rem2 <= 1)
+        // Check if a chain was found
+        if (fChainFound)
         {
-            inverse = aux2;
-            break;
+            mpz_class mpzPrimeChainMultiplier;
+            mpz_mul_uint64(mpzPrimeChainMultiplier, winfo.mpzFixedMultiplier, nTriedMultiplier);
+            CBigNum bnPrimeChainMultiplier;
+            bnPrimeChainMultiplier.SetHex(mpzPrimeChainMultiplier.get_str(16));
+            winfo.bnPrimeChainMultiplier = bnPrimeChainMultiplier;
+            printf("nTriedMultiplier = %"PRI64u"\n", nTriedMultiplier); // Debugging
+            return true;
         }
+    }
 
-        rem0 = rem1 % rem2;
-        quotient = rem1 / rem2;
-        aux0 = -quotient * aux2 + aux1;
+    // The remaining candidates belong to the replaced sieve
+    vCandidates.clear();
+    nCandidateNext = 0;
+    return false; // sieve replaced by the leader
+}
 
-        if (rem0 <= 1)
-        {
-            inverse = aux0;
-            break;
-        }
+CSieveGroup::CSieveGroup()
+{
+    nGeneration = 0;
+    fPublished = false;
+    nBusy = 0;
+    pleader = NULL;
+    nTests = 0;
+    nPrimesHit = 0;
+    for (unsigned int i = 0; i < nMaxChainLength; i++)
+        vChainsFound[i] = 0;
+    sieve.SetSharedWeave(true);
+}
+
+CSieveGroup::~CSieveGroup()
+{
+}
+
+void CSieveGroup::Retire()
+{
+    boost::this_thread::disable_interruption di;
+    boost::mutex::scoped_lock lock(cs);
+    fPublished = false;
+    nGeneration++;
+    while (nBusy > 0)
+        cond.wait(lock);
+}
+
+bool CSieveGroup::Weave(ThreadWorkManager &wmanager, const WorkInfo& winfo)
+{
+    if (!sieve.WeaveMultipliers(wmanager))
+        return false;
 
-        rem1 = rem2 % rem0;
-        quotient = rem2 / rem0;
-        aux1 = -quotient * aux0 + aux2;
+    // Open the sieve for the followers
+    {
+        boost::mutex::scoped_lock lock(cs);
+        spwinfo.reset(new WorkInfo(winfo));
+        pleader = &wmanager;
+        fPublished = true;
+    }
+    cond.notify_all();
+    return true;
+}
+
+unsigned int CSieveGroup::Join(unsigned int nGeneration, std::unique_ptr<WorkInfo>& spwinfo)
+{
+    boost::mutex::scoped_lock lock(cs);
+    while (!fPublished || this->nGeneration == nGeneration)
+        cond.wait(lock);
+    nBusy++;
+    spwinfo.reset(new WorkInfo(*this->spwinfo));
+    return this->nGeneration;
+}
+
+void CSieveGroup::Leave()
+{
+    {
+        boost::mutex::scoped_lock lock(cs);
+        nBusy--;
     }
+    cond.notify_all();
+}
 
-    return (inverse + nPrime) % nPrime;
+void CSieveGroup::AddStatistics(unsigned int nTests, unsigned int nPrimesHit, unsigned int nChainPrimeLength)
+{
+#ifdef USE_GCC_BUILTINS
+    __sync_add_and_fetch(&this->nTests, nTests);
+    __sync_add_and_fetch(&this->nPrimesHit, nPrimesHit);
+    if (nChainPrimeLength >= 1)
+        __sync_add_and_fetch(&vChainsFound[nChainPrimeLength - 1], 1);
+#else
+    boost::mutex::scoped_lock lock(cs);
+    this->nTests += nTests;
+    this->nPrimesHit += nPrimesHit;
+    if (nChainPrimeLength >= 1)
+        vChainsFound[nChainPrimeLength - 1]++;
+#endif
+}
+
+void CSieveGroup::HarvestStatistics(WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength])
+{
+#ifdef USE_GCC_BUILTINS
+    winfo.nTests += __sync_fetch_and_and(&nTests, 0);
+    winfo.nPrimesHit += __sync_fetch_and_and(&nPrimesHit, 0);
+    for (unsigned int i = 0; i < nMaxChainLength; i++)
+        vChainsFound[i] += __sync_fetch_and_and(&this->vChainsFound[i], 0);
+#else
+    boost::mutex::scoped_lock lock(cs);
+    winfo.nTests += nTests;
+    winfo.nPrimesHit += nPrimesHit;
+    nTests = 0;
+    nPrimesHit = 0;
+    for (unsigned int i = 0; i < nMaxChainLength; i++)
+    {
+        vChainsFound[i] += this->vChainsFound[i];
+        this->vChainsFound[i] = 0;
+    }
+#endif
 }
 
-void CSieveOfEratosthenes::ProcessMultiplier(sieve_word_t *vfComposites, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int *vMultipliers, unsigned int nLayerSeq)
+// Weave a layer of both the CC1 and the CC2 arrays
+//
+// The two chains are marked by the same primes from different starting
+// multipliers into different arrays. Their loops are interleaved so that
+// the two independent dependency chains keep more of the core busy.
+void CSieveOfEratosthenes::ProcessMultiplier(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int nLayerSeq)
 {
-    // Wipe the part of the array first
+    // Wipe the part of the arrays first
     if (nMinMultiplier < nMaxMultiplier)
     {
-        memset(vfComposites + GetWordNum(nMinMultiplier), 0, (nMaxMultiplier - nMinMultiplier + nWordBits - 1) / nWordBits * sizeof(sieve_word_t));
+        const unsigned int nMinWord = GetWordNum(nMinMultiplier);
+        const unsigned int nMaxWord = (nMaxMultiplier + nWordBits - 1) / nWordBits;
 
-        for (unsigned int nPrimeSeq = 1; nPrimeSeq < nPrimes; nPrimeSeq++)
+        // The primes smaller than a word hit every word, so their patterns
+        // are combined a word at a time instead of marking single bits
+        const sieve_word_t *vTiles[nTileWordBits];
+        unsigned int vTilePrimes[nTileWordBits];
+        unsigned int vTileSteps[nTileWordBits];
+        unsigned int vTileOffsetsCC1[nTileWordBits];
+        unsigned int vTileOffsetsCC2[nTileWordBits];
+        unsigned int nTiles = 0;
+        for (unsigned int nPrimeSeq = 1; nPrimeSeq < nTilePrimes; nPrimeSeq++)
         {
+            // The multipliers of the tile primes are never moved on, only
+            // their residues are used
+            unsigned int nMultiplierCC1, nMultiplierCC2;
+            if (nPrimeSeq < nCompactPrimeSeq)
+            {
+                const CCompactMultipliers& multipliers = vCompactMultipliers[nPrimeSeq * nSieveLayers + nLayerSeq];
+                if (multipliers.nOffsetCC1 == nCompactMultiplierNone)
+                    continue;  // prime divides the fixed factor
+                nMultiplierCC1 = GetLayerMinMultiplier(nLayerSeq) + multipliers.nOffsetCC1;
+                nMultiplierCC2 = GetLayerMinMultiplier(nLayerSeq) + multipliers.nOffsetCC2;
+            }
+            else
+            {
+                nMultiplierCC1 = vCunningham1Multipliers[GetMultiplierIndex(nPrimeSeq, nLayerSeq)];
+                nMultiplierCC2 = vCunningham2Multipliers[GetMultiplierIndex(nPrimeSeq, nLayerSeq)];
+                if (nMultiplierCC1 == UINT_MAX)
+                    continue;  // prime divides the fixed factor
+            }
             const unsigned int nPrime = vPrimes[nPrimeSeq];
-            unsigned int nVariableMultiplier = vMultipliers[nPrimeSeq * nSieveLayers + nLayerSeq];
-            if (nVariableMultiplier < nMinMultiplier)
-                nVariableMultiplier += (nMinMultiplier - nVariableMultiplier + nPrime - 1) / nPrime * nPrime;
-#ifdef USE_ROTATE
-            const unsigned int nRotateBits = nPrime % nWordBits;
-            sieve_word_t lBitMask = GetBitMask(nVariableMultiplier);
-            for (; nVariableMultiplier < nMaxMultiplier; nVariableMultiplier += nPrime)
+            const unsigned int nMinOffset = nMinWord * nWordBits % nPrime;
+            vTiles[nTiles] = &vPrimeTiles[nPrimeSeq * nTileWordBits];
+            vTilePrimes[nTiles] = nPrime;
+            vTileSteps[nTiles] = nWordBits % nPrime;
+            vTileOffsetsCC1[nTiles] = (nMinOffset + nPrime - nMultiplierCC1 % nPrime) % nPrime;
+            vTileOffsetsCC2[nTiles] = (nMinOffset + nPrime - nMultiplierCC2 % nPrime) % nPrime;
+            nTiles++;
+        }
+
+        // Weave the small primes one L1 cache sized chunk at a time
+        unsigned int nChunkMaxMultiplier;
+        for (unsigned int nChunkMinMultiplier = nMinMultiplier; nChunkMinMultiplier < nMaxMultiplier; nChunkMinMultiplier = nChunkMaxMultiplier)
+        {
+            nChunkMaxMultiplier = std::min((nChunkMinMultiplier / nL1CacheElements + 1) * nL1CacheElements, nMaxMultiplier);
+            const unsigned int nChunkMinWord = GetWordNum(nChunkMinMultiplier);
+            const unsigned int nChunkMaxWord = (nChunkMaxMultiplier + nWordBits - 1) / nWordBits;
+
+            if (nTiles == 0)
             {
-                vfComposites[GetWordNum(nVariableMultiplier)] |= lBitMask;
-                lBitMask = rotate_left(lBitMask, nRotateBits);
+                memset(vfCompositesCC1 + nChunkMinWord, 0, (nChunkMaxWord - nChunkMinWord) * sizeof(sieve_word_t));
+                memset(vfCompositesCC2 + nChunkMinWord, 0, (nChunkMaxWord - nChunkMinWord) * sizeof(sieve_word_t));
             }
-            vMultipliers[nPrimeSeq * nSieveLayers + nLayerSeq] = nVariableMultiplier;
-#else
-            for (; nVariableMultiplier < nMaxMultiplier; nVariableMultiplier += nPrime)
+            else
             {
-                vfComposites[GetWordNum(nVariableMultiplier)] |= GetBitMask(nVariableMultiplier);
+                for (unsigned int nWord = nChunkMinWord; nWord < nChunkMaxWord; nWord++)
+                {
+                    sieve_word_t lBitsCC1 = 0;
+                    sieve_word_t lBitsCC2 = 0;
+                    for (unsigned int i = 0; i < nTiles; i++)
+                    {
+                        lBitsCC1 |= vTiles[i][vTileOffsetsCC1[i]];
+                        lBitsCC2 |= vTiles[i][vTileOffsetsCC2[i]];
+                        vTileOffsetsCC1[i] += vTileSteps[i];
+                        vTileOffsetsCC2[i] += vTileSteps[i];
+                        if (vTileOffsetsCC1[i] >= vTilePrimes[i])
+                            vTileOffsetsCC1[i] -= vTilePrimes[i];
+                        if (vTileOffsetsCC2[i] >= vTilePrimes[i])
+                            vTileOffsetsCC2[i] -= vTilePrimes[i];
+                    }
+                    vfCompositesCC1[nWord] = lBitsCC1;
+                    vfCompositesCC2[nWord] = lBitsCC2;
+                }
+
+                // Clear the bits outside of the range in the boundary words
+                if (nChunkMinMultiplier == nMinMultiplier)
+                {
+                    const sieve_word_t lMask = ~(sieve_word_t)0 << (nMinMultiplier % nWordBits);
+                    vfCompositesCC1[nMinWord] &= lMask;
+                    vfCompositesCC2[nMinWord] &= lMask;
+                }
+                if (nChunkMaxMultiplier == nMaxMultiplier && nMaxMultiplier % nWordBits)
+                {
+                    const sieve_word_t lMask = ((sieve_word_t)1 << (nMaxMultiplier % nWordBits)) - 1;
+                    vfCompositesCC1[nMaxWord - 1] &= lMask;
+                    vfCompositesCC2[nMaxWord - 1] &= lMask;
+                }
             }
-            vMultipliers[nPrimeSeq * nSieveLayers + nLayerSeq] = nVariableMultiplier;
+
+            ProcessPrimes(vfCompositesCC1, vfCompositesCC2, nChunkMinMultiplier, nChunkMaxMultiplier, vPrimes, nLayerSeq, nTilePrimes, nChunkPrimeSeq);
+        }
+
+        // The medium primes hit a chunk only a few times, weave them once
+        // for the whole segment
+        ProcessPrimes(vfCompositesCC1, vfCompositesCC2, nMinMultiplier, nMaxMultiplier, vPrimes, nLayerSeq, nChunkPrimeSeq, nBucketPrimeSeq);
+    }
+}
+
+// Mark the multipliers of a prime from the first ones at or above the range
+// up to nMaxMultiplier, the first multipliers of the next range are left in
+// nMultiplierCC1 and nMultiplierCC2
+inline void CSieveOfEratosthenes::MarkMultipliers(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, unsigned int& nMultiplierCC1, unsigned int& nMultiplierCC2, const unsigned int nMaxMultiplier, const unsigned int nPrime, const unsigned int nPrimeSeq)
+{
+#ifdef USE_ROTATE
+    const unsigned int nRotateBits = pPrimeConstants->vRotateBits[nPrimeSeq];
+    sieve_word_t lBitMaskCC1 = GetBitMask(nMultiplierCC1);
+    sieve_word_t lBitMaskCC2 = GetBitMask(nMultiplierCC2);
+    for (; nMultiplierCC1 < nMaxMultiplier && nMultiplierCC2 < nMaxMultiplier; nMultiplierCC1 += nPrime, nMultiplierCC2 += nPrime)
+    {
+        vfCompositesCC1[GetWordNum(nMultiplierCC1)] |= lBitMaskCC1;
+        vfCompositesCC2[GetWordNum(nMultiplierCC2)] |= lBitMaskCC2;
+        lBitMaskCC1 = rotate_left(lBitMaskCC1, nRotateBits);
+        lBitMaskCC2 = rotate_left(lBitMaskCC2, nRotateBits);
+    }
+    for (; nMultiplierCC1 < nMaxMultiplier; nMultiplierCC1 += nPrime)
+    {
+        vfCompositesCC1[GetWordNum(nMultiplierCC1)] |= lBitMaskCC1;
+        lBitMaskCC1 = rotate_left(lBitMaskCC1, nRotateBits);
+    }
+    for (; nMultiplierCC2 < nMaxMultiplier; nMultiplierCC2 += nPrime)
+    {
+        vfCompositesCC2[GetWordNum(nMultiplierCC2)] |= lBitMaskCC2;
+        lBitMaskCC2 = rotate_left(lBitMaskCC2, nRotateBits);
+    }
+#else
+    for (; nMultiplierCC1 < nMaxMultiplier && nMultiplierCC2 < nMaxMultiplier; nMultiplierCC1 += nPrime, nMultiplierCC2 += nPrime)
+    {
+        vfCompositesCC1[GetWordNum(nMultiplierCC1)] |= GetBitMask(nMultiplierCC1);
+        vfCompositesCC2[GetWordNum(nMultiplierCC2)] |= GetBitMask(nMultiplierCC2);
+    }
+    for (; nMultiplierCC1 < nMaxMultiplier; nMultiplierCC1 += nPrime)
+        vfCompositesCC1[GetWordNum(nMultiplierCC1)] |= GetBitMask(nMultiplierCC1);
+    for (; nMultiplierCC2 < nMaxMultiplier; nMultiplierCC2 += nPrime)
+        vfCompositesCC2[GetWordNum(nMultiplierCC2)] |= GetBitMask(nMultiplierCC2);
 #endif
+}
+
+// Mark the multipliers of a range of primes with the multiplier arrays
+void CSieveOfEratosthenes::ProcessPrimes(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int nLayerSeq, unsigned int nMinPrimeSeq, unsigned int nMaxPrimeSeq)
+{
+    nMaxPrimeSeq = std::min(nMaxPrimeSeq, vLayerPrimes[nLayerSeq]);
+    unsigned int nPrimeSeq = nMinPrimeSeq;
+
+    // The compact offsets of the ranges weaved in order are relative to the
+    // start of the range. Shared segments are weaved out of order so their
+    // offsets are kept relative to the start of the layer.
+    const unsigned int nCompactBase = fSharedWeave ? GetLayerMinMultiplier(nLayerSeq) : nMinMultiplier;
+    for (; nPrimeSeq < std::min(nMaxPrimeSeq, nCompactPrimeSeq); nPrimeSeq++)
+    {
+        CCompactMultipliers& multipliers = vCompactMultipliers[nPrimeSeq * nSieveLayers + nLayerSeq];
+        if (multipliers.nOffsetCC1 == nCompactMultiplierNone)
+            continue;  // prime divides the fixed factor
+        const unsigned int nPrime = vPrimes[nPrimeSeq];
+        unsigned int nMultiplierCC1 = nCompactBase + multipliers.nOffsetCC1;
+        unsigned int nMultiplierCC2 = nCompactBase + multipliers.nOffsetCC2;
+        if (fSharedWeave)
+        {
+            const unsigned int nReciprocal = pPrimeConstants->vReciprocals[nPrimeSeq];
+            if (nMultiplierCC1 < nMinMultiplier)
+                nMultiplierCC1 += DivideByPrime(nMinMultiplier - nMultiplierCC1 + nPrime - 1, nPrime, nReciprocal) * nPrime;
+            if (nMultiplierCC2 < nMinMultiplier)
+                nMultiplierCC2 += DivideByPrime(nMinMultiplier - nMultiplierCC2 + nPrime - 1, nPrime, nReciprocal) * nPrime;
+        }
+        MarkMultipliers(vfCompositesCC1, vfCompositesCC2, nMultiplierCC1, nMultiplierCC2, nMaxMultiplier, nPrime, nPrimeSeq);
+        if (!fSharedWeave)
+        {
+            multipliers.nOffsetCC1 = nMultiplierCC1 - nMaxMultiplier;
+            multipliers.nOffsetCC2 = nMultiplierCC2 - nMaxMultiplier;
+        }
+    }
+
+    for (; nPrimeSeq < nMaxPrimeSeq; nPrimeSeq++)
+    {
+        const unsigned int nPrime = vPrimes[nPrimeSeq];
+        const unsigned int nReciprocal = pPrimeConstants->vReciprocals[nPrimeSeq];
+        const unsigned int nMultiplierIndex = GetMultiplierIndex(nPrimeSeq, nLayerSeq);
+        unsigned int nMultiplierCC1 = vCunningham1Multipliers[nMultiplierIndex];
+        unsigned int nMultiplierCC2 = vCunningham2Multipliers[nMultiplierIndex];
+        if (nMultiplierCC1 < nMinMultiplier)
+            nMultiplierCC1 += DivideByPrime(nMinMultiplier - nMultiplierCC1 + nPrime - 1, nPrime, nReciprocal) * nPrime;
+        if (nMultiplierCC2 < nMinMultiplier)
+            nMultiplierCC2 += DivideByPrime(nMinMultiplier - nMultiplierCC2 + nPrime - 1, nPrime, nReciprocal) * nPrime;
+        MarkMultipliers(vfCompositesCC1, vfCompositesCC2, nMultiplierCC1, nMultiplierCC2, nMaxMultiplier, nPrime, nPrimeSeq);
+        // Shared segments are weaved out of order so keep the first multiplier
+        if (!fSharedWeave)
+        {
+            vCunningham1Multipliers[nMultiplierIndex] = nMultiplierCC1;
+            vCunningham2Multipliers[nMultiplierIndex] = nMultiplierCC2;
         }
     }
 }
 
-// Weave sieve for the next prime in table
-// Return values:
-//   True  - weaved another prime; nComposite - number of composites removed
-//   False - sieve already completed
-bool CSieveOfEratosthenes::Weave(ThreadWorkManager &wmanager)
+// Mark the multipliers filed into a bucket by the large primes
+void CSieveOfEratosthenes::ProcessBucket(sieve_word_t *vfComposites, const std::vector<unsigned int>& vBucket)
+{
+    const unsigned int *pMultiplier = vBucket.empty() ? NULL : &vBucket[0];
+    const unsigned int *pMultiplierEnd = pMultiplier + vBucket.size();
+    for (; pMultiplier < pMultiplierEnd; pMultiplier++)
+        vfComposites[GetWordNum(*pMultiplier)] |= GetBitMask(*pMultiplier);
+}
+
+// Claim, weave and complete the next segment
+bool CSieveOfEratosthenes::WeaveNextSegment(ThreadWorkManager *pwmanager)
+{
+    unsigned int nSegment;
+    if (!ClaimSegment(nSegment))
+        return false;
+    if (!WeaveSegment(pwmanager, nSegment))
+        return false;  // new block
+    CompleteSegment(nSegment);
+    return true;
+}
+
+// Find the first multiplier divisible by each prime for every layer
+bool CSieveOfEratosthenes::WeaveMultipliers(ThreadWorkManager &wmanager)
 {
-    // Check whether fixed multiplier fits in an unsigned long
-    bool fUseLongForFixedMultiplier = mpzFixedMultiplier < ULONG_MAX;
-    unsigned long nFixedMultiplier = mpzFixedMultiplier.get_ui();
+    if (wmanager.FNewWork())
+        return false;  // new block
+
+    const std::vector<unsigned int>& vPrimes = *pvPrimes;
 
-    unsigned int nCombinedEndSeq = 1;
-    unsigned int nFixedFactorCombinedMod = 0;
+    // Reduce the fixed factor modulo each prime
+    vFixedInverses.resize(nPrimes);
+    ReducePrimeGroups(mpzHashFixedMult, nPrimes, &vFixedInverses[0], vPrimes, *pPrimeConstants);
+
+    // Find the modulo inverses of fixed factor
+    BatchInvert(&vFixedInverses[1], &vFixedInverses[1], &vPrimes[1], nPrimes - 1);
 
     for (unsigned int nPrimeSeqLocal = 1; nPrimeSeqLocal < nPrimes; nPrimeSeqLocal++)
     {
         if (wmanager.FNewWork())
-            break;  // new block
+            return false;  // new block
         unsigned int nPrime = vPrimes[nPrimeSeqLocal];
-        if (nPrimeSeqLocal >= nCombinedEndSeq)
+        unsigned int nFixedInverse = vFixedInverses[nPrimeSeqLocal];
+        if (nFixedInverse == 0)
         {
-            // Combine multiple primes to produce a big divisor
-            unsigned int nPrimeCombined = 1;
-            while (nPrimeCombined < UINT_MAX / vPrimes[nCombinedEndSeq])
+            // Nothing in the sieve is divisible by this prime
+            if (nPrimeSeqLocal < nCompactPrimeSeq)
             {
-                nPrimeCombined *= vPrimes[nCombinedEndSeq];
-                nCombinedEndSeq++;
+                for (unsigned int nChainSeq = 0; nChainSeq < nSieveLayers; nChainSeq++)
+                {
+                    vCompactMultipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq].nOffsetCC1 = nCompactMultiplierNone;
+                    vCompactMultipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq].nOffsetCC2 = nCompactMultiplierNone;
+                }
             }
-
-            if (fUseLongForFixedMultiplier)
+            else if (nPrimeSeqLocal < nBucketPrimeSeq)
             {
-                nFixedFactorCombinedMod = mpz_tdiv_ui(mpzHash.get_mpz_t(), nPrimeCombined);
-                nFixedFactorCombinedMod = (uint64)nFixedFactorCombinedMod * (nFixedMultiplier % nPrimeCombined) % nPrimeCombined;
+                for (unsigned int nChainSeq = 0; nChainSeq < nSieveLayers; nChainSeq++)
+                {
+                    vCunningham1Multipliers[GetMultiplierIndex(nPrimeSeqLocal, nChainSeq)] = UINT_MAX;
+                    vCunningham2Multipliers[GetMultiplierIndex(nPrimeSeqLocal, nChainSeq)] = UINT_MAX;
+                }
             }
-            else
-                nFixedFactorCombinedMod = mpz_tdiv_ui(mpzHashFixedMult.get_mpz_t(), nPrimeCombined);
-        }
-
-        unsigned int nFixedFactorMod = nFixedFactorCombinedMod % nPrime;
-        if (nFixedFactorMod == 0)
-        {
-            // Nothing in the sieve is divisible by this prime
             continue;
         }
-        // Find the modulo inverse of fixed factor
-        unsigned int nFixedInverse = int_invert(nFixedFactorMod, nPrime);
-        if (!nFixedInverse)
-            return error("CSieveOfEratosthenes::Weave(): int_invert of fixed factor failed for prime #%u=%u", nPrimeSeqLocal, vPrimes[nPrimeSeqLocal]);
-        unsigned int nTwoInverse = (nPrime + 1) / 2;
 
-        // Check whether 32-bit arithmetic can be used for nFixedInverse
-        const bool fUse32BArithmetic = (UINT_MAX / nTwoInverse) >= nPrime;
+        if (nPrimeSeqLocal >= nBucketPrimeSeq)
+        {
+            // File the multipliers of the large prime into the buckets
+            const unsigned int nReciprocal = pPrimeConstants->vReciprocals[nPrimeSeqLocal];
+            for (unsigned int nChainSeq = 0; nChainSeq < nSieveLayers; nChainSeq++)
+            {
+                if (nPrimeSeqLocal < vLayerPrimes[nChainSeq])
+                {
+                    FillBuckets(vCunningham1Buckets, nFixedInverse, nPrime, nReciprocal, nChainSeq);
+                    FillBuckets(vCunningham2Buckets, nPrime - nFixedInverse, nPrime, nReciprocal, nChainSeq);
+                }
 
-        if (fUse32BArithmetic)
+                // For next number in chain
+                nFixedInverse = HalveModPrime(nFixedInverse, nPrime);
+            }
+        }
+        else if (nPrimeSeqLocal < nCompactPrimeSeq)
         {
-            // Weave the sieve for the prime
+            // Offsets from the start of each layer, the extension layers
+            // start halfway through the sieve
+            const unsigned int nHalfResidue = nSieveSize / 2 % nPrime;
             for (unsigned int nChainSeq = 0; nChainSeq < nSieveLayers; nChainSeq++)
             {
-                // Find the first number that's divisible by this prime
-                vCunningham1Multipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq] = nFixedInverse;
-                vCunningham2Multipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq] = nPrime - nFixedInverse;
+                unsigned int nOffsetCC1 = nFixedInverse;
+                unsigned int nOffsetCC2 = nPrime - nFixedInverse;
+                if (nChainSeq >= nChainLength)
+                {
+                    nOffsetCC1 = (nOffsetCC1 + nPrime - nHalfResidue) % nPrime;
+                    nOffsetCC2 = (nOffsetCC2 + nPrime - nHalfResidue) % nPrime;
+                }
+                vCompactMultipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq].nOffsetCC1 = nOffsetCC1;
+                vCompactMultipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq].nOffsetCC2 = nOffsetCC2;
 
                 // For next number in chain
-                nFixedInverse = nFixedInverse * nTwoInverse % nPrime;
+                nFixedInverse = HalveModPrime(nFixedInverse, nPrime);
             }
         }
         else
@@ -1103,150 +1650,254 @@ bool CSieveOfEratosthenes::Weave(ThreadWorkManager &wmanager)
             for (unsigned int nChainSeq = 0; nChainSeq < nSieveLayers; nChainSeq++)
             {
                 // Find the first number that's divisible by this prime
-                vCunningham1Multipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq] = nFixedInverse;
-                vCunningham2Multipliers[nPrimeSeqLocal * nSieveLayers + nChainSeq] = nPrime - nFixedInverse;
+                vCunningham1Multipliers[GetMultiplierIndex(nPrimeSeqLocal, nChainSeq)] = nFixedInverse;
+                vCunningham2Multipliers[GetMultiplierIndex(nPrimeSeqLocal, nChainSeq)] = nPrime - nFixedInverse;
 
                 // For next number in chain
-                nFixedInverse = (uint64)nFixedInverse * nTwoInverse % nPrime;
+                nFixedInverse = HalveModPrime(nFixedInverse, nPrime);
             }
         }
     }
 
-    // Process the array in chunks that fit the L1 cache
-    const unsigned int nArrayRounds = (nSieveSize + nL1CacheElements - 1) / nL1CacheElements;
+    return true;
+}
+
+static void ClearWords(sieve_word_t *vfWords, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    if (nMinWord < nMaxWord)
+        memset(vfWords + nMinWord, 0, (nMaxWord - nMinWord) * sizeof(sieve_word_t));
+}
+
+// Range of the specialized instances of WeaveSegmentLayers
+static const unsigned int nMinFixedWeaveChainLength = 9;
+static const unsigned int nMaxFixedWeaveChainLength = 12;
+static const unsigned int nMaxFixedWeaveExtensions = 12;
+
+// Fully unroll the loops of the fixed instances, at most
+// nMaxFixedWeaveChainLength + nMaxFixedWeaveExtensions layers
+#if defined(__clang__)
+#define WEAVE_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define WEAVE_UNROLL _Pragma("GCC unroll 24")
+#else
+#define WEAVE_UNROLL
+#endif
+
+// Weave a single L2 cache sized segment of the sieve
+template<bool fFixed, unsigned int ChainLength, unsigned int Extensions>
+bool CSieveOfEratosthenes::WeaveSegmentLayers(ThreadWorkManager *pwmanager, unsigned int nSegment)
+{
+    const unsigned int nChainLength = fFixed ? ChainLength : this->nChainLength;
+    const unsigned int nSieveExtensions = fFixed ? Extensions : this->nSieveExtensions;
+    const unsigned int nSieveLayers = nChainLength + nSieveExtensions;
 
     // Calculate the number of CC1 and CC2 layers needed for BiTwin candidates
     const unsigned int nBiTwinCC1Layers = (nChainLength + 1) / 2;
     const unsigned int nBiTwinCC2Layers = nChainLength / 2;
 
-    // Only 50% of the array is used in extensions
+    // Only 50% of the array is used in extensions, the words from
+    // nExtendedMinWord on are stored
     const unsigned int nExtensionsMinMultiplier = nSieveSize / 2;
-    const unsigned int nExtensionsMinWord = nExtensionsMinMultiplier / nWordBits;
 
-    // Loop over each array one at a time for optimal L1 cache performance
-    for (unsigned int j = 0; j < nArrayRounds; j++)
+    const unsigned int nMinMultiplier = nSegmentElements * nSegment;
+    const unsigned int nMaxMultiplier = std::min(nSegmentElements * (nSegment + 1), nSieveSize);
+    const unsigned int nExtMinMultiplier = std::max(nMinMultiplier, nExtensionsMinMultiplier);
+    const unsigned int nMinWord = nMinMultiplier / nWordBits;
+    const unsigned int nMaxWord = (nMaxMultiplier + nWordBits - 1) / nWordBits;
+    const unsigned int nExtMinWord = std::max(nMinWord, nExtendedMinWord);
+    if (pwmanager && pwmanager->FNewWork())
+        return false;  // new block
+
+    // Clear the composites of the segment, Reset leaves the arrays as they are
+    if (nArrayStride == 1)
     {
-        const unsigned int nMinMultiplier = nL1CacheElements * j;
-        const unsigned int nMaxMultiplier = std::min(nL1CacheElements * (j + 1), nSieveSize);
-        const unsigned int nExtMinMultiplier = std::max(nMinMultiplier, nExtensionsMinMultiplier);
-        const unsigned int nMinWord = nMinMultiplier / nWordBits;
-        const unsigned int nMaxWord = (nMaxMultiplier + nWordBits - 1) / nWordBits;
-        const unsigned int nExtMinWord = std::max(nMinWord, nExtensionsMinWord);
-        if (wmanager.FNewWork())
-            break;  // new block
-
-        // Loop over the layers
-        for (unsigned int nLayerSeq = 0; nLayerSeq < nSieveLayers; nLayerSeq++) {
-            if (wmanager.FNewWork())
-                break;  // new block
-            if (nLayerSeq < nChainLength)
-            {
-                ProcessMultiplier(vfCompositeLayerCC1, nMinMultiplier, nMaxMultiplier, vPrimes, vCunningham1Multipliers, nLayerSeq);
-                ProcessMultiplier(vfCompositeLayerCC2, nMinMultiplier, nMaxMultiplier, vPrimes, vCunningham2Multipliers, nLayerSeq);
-            }
-            else
-            {
-                // Optimize: First halves of the arrays are not needed in the extensions
-                ProcessMultiplier(vfCompositeLayerCC1, nExtMinMultiplier, nMaxMultiplier, vPrimes, vCunningham1Multipliers, nLayerSeq);
-                ProcessMultiplier(vfCompositeLayerCC2, nExtMinMultiplier, nMaxMultiplier, vPrimes, vCunningham2Multipliers, nLayerSeq);
-            }
+        ClearWords(vfCompositeBiTwin, nMinWord, nMaxWord);
+        ClearWords(vfCompositeCunningham1, nMinWord, nMaxWord);
+        ClearWords(vfCompositeCunningham2, nMinWord, nMaxWord);
+        for (unsigned int j = 0; j < nSieveExtensions; j++)
+        {
+            ClearWords(GetExtendedArray(vfExtendedCompositeBiTwin, j), nExtMinWord, nMaxWord);
+            ClearWords(GetExtendedArray(vfExtendedCompositeCunningham1, j), nExtMinWord, nMaxWord);
+            ClearWords(GetExtendedArray(vfExtendedCompositeCunningham2, j), nExtMinWord, nMaxWord);
+        }
+    }
+    else
+    {
+        ClearWords(vfCandidates, nMinWord * nArrayStride, nMaxWord * nArrayStride);
+        for (unsigned int j = 0; j < nSieveExtensions; j++)
+            ClearWords(GetExtendedArray(vfExtendedCandidates, j), nExtMinWord * nArrayStride, nMaxWord * nArrayStride);
+    }
 
-            // Apply the layer to the primary sieve arrays
-            if (nLayerSeq < nChainLength)
+    // Loop over the layers
+    WEAVE_UNROLL
+    for (unsigned int nLayerSeq = 0; nLayerSeq < nSieveLayers; nLayerSeq++) {
+        if (pwmanager && pwmanager->FNewWork())
+            return false;  // new block
+        if (nLayerSeq < nChainLength)
+            ProcessMultiplier(vfCompositeLayerCC1, vfCompositeLayerCC2, nMinMultiplier, nMaxMultiplier, *pvPrimes, nLayerSeq);
+        else
+        {
+            // Optimize: First halves of the arrays are not needed in the extensions
+            ProcessMultiplier(vfCompositeLayerCC1, vfCompositeLayerCC2, nExtMinMultiplier, nMaxMultiplier, *pvPrimes, nLayerSeq);
+        }
+        ProcessBucket(vfCompositeLayerCC1, vCunningham1Buckets[nSegment * nSieveLayers + nLayerSeq]);
+        ProcessBucket(vfCompositeLayerCC2, vCunningham2Buckets[nSegment * nSieveLayers + nLayerSeq]);
+
+        // Apply the layer to the primary sieve and to the extensions it
+        // covers in one pass. The extensions sieve the layer at smaller
+        // indexes of their chains, so going from the last extension to the
+        // primary sieve sorts the sets by decreasing BiTwin contribution.
+        CCompositeSet vSets[nMaxSieveExtensions + 1];
+        unsigned int nSets = 0;
+        unsigned int nBoth = 0;
+        unsigned int nCC1 = 0;
+        WEAVE_UNROLL
+        for (unsigned int i = 0; i < nSieveExtensions; i++)
+        {
+            const unsigned int nExtensionSeq = nSieveExtensions - 1 - i;
+            const unsigned int nLayerOffset = nExtensionSeq + 1;
+            if (nLayerSeq >= nLayerOffset && nLayerSeq < nChainLength + nLayerOffset)
             {
-                if (nLayerSeq < nBiTwinCC2Layers)
-                {
-                    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
-                    {
-                        vfCompositeCunningham1[nWord] |= vfCompositeLayerCC1[nWord];
-                        vfCompositeCunningham2[nWord] |= vfCompositeLayerCC2[nWord];
-                        vfCompositeBiTwin[nWord] |= vfCompositeLayerCC1[nWord] | vfCompositeLayerCC2[nWord];
-                    }
-                }
-                else if (nLayerSeq < nBiTwinCC1Layers)
-                {
-                    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
-                    {
-                        vfCompositeCunningham1[nWord] |= vfCompositeLayerCC1[nWord];
-                        vfCompositeCunningham2[nWord] |= vfCompositeLayerCC2[nWord];
-                        vfCompositeBiTwin[nWord] |= vfCompositeLayerCC1[nWord];
-                    }
-                }
-                else
-                {
-                    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
-                    {
-                        vfCompositeCunningham1[nWord] |= vfCompositeLayerCC1[nWord];
-                        vfCompositeCunningham2[nWord] |= vfCompositeLayerCC2[nWord];
-                    }
-                }
+                const unsigned int nLayerExtendedSeq = nLayerSeq - nLayerOffset;
+                nBoth += (nLayerExtendedSeq < nBiTwinCC2Layers);
+                nCC1 += (nLayerExtendedSeq >= nBiTwinCC2Layers && nLayerExtendedSeq < nBiTwinCC1Layers);
+                vSets[nSets].vfCompositeCC1 = GetExtendedArray(vfExtendedCompositeCunningham1, nExtensionSeq);
+                vSets[nSets].vfCompositeCC2 = GetExtendedArray(vfExtendedCompositeCunningham2, nExtensionSeq);
+                vSets[nSets].vfCompositeTWN = GetExtendedArray(vfExtendedCompositeBiTwin, nExtensionSeq);
+                nSets++;
             }
+        }
+        const unsigned int nExtSets = nSets;
+        unsigned int nPrimaryMaxWord = nMinWord;
+        if (nLayerSeq < nChainLength)
+        {
+            nBoth += (nLayerSeq < nBiTwinCC2Layers);
+            nCC1 += (nLayerSeq >= nBiTwinCC2Layers && nLayerSeq < nBiTwinCC1Layers);
+            vSets[nSets].vfCompositeCC1 = vfCompositeCunningham1;
+            vSets[nSets].vfCompositeCC2 = vfCompositeCunningham2;
+            vSets[nSets].vfCompositeTWN = vfCompositeBiTwin;
+            nSets++;
+            nPrimaryMaxWord = (nExtSets > 0) ? std::min(nExtMinWord, nMaxWord) : nMaxWord;
+        }
 
-            // Apply the layer to extensions
-            for (unsigned int nExtensionSeq = 0; nExtensionSeq < nSieveExtensions; nExtensionSeq++)
-            {
-                const unsigned int nLayerOffset = nExtensionSeq + 1;
-                if (nLayerSeq >= nLayerOffset && nLayerSeq < nChainLength + nLayerOffset)
-                {
-                    const unsigned int nLayerExtendedSeq = nLayerSeq - nLayerOffset;
-                    sieve_word_t *vfExtCC1 = vfExtendedCompositeCunningham1 + nExtensionSeq * nCandidatesWords;
-                    sieve_word_t *vfExtCC2 = vfExtendedCompositeCunningham2 + nExtensionSeq * nCandidatesWords;
-                    sieve_word_t *vfExtTWN = vfExtendedCompositeBiTwin + nExtensionSeq * nCandidatesWords;
-                    if (nLayerExtendedSeq < nBiTwinCC2Layers)
-                    {
-                        for (unsigned int nWord = nExtMinWord; nWord < nMaxWord; nWord++)
-                        {
-                            vfExtCC1[nWord] |= vfCompositeLayerCC1[nWord];
-                            vfExtCC2[nWord] |= vfCompositeLayerCC2[nWord];
-                            vfExtTWN[nWord] |= vfCompositeLayerCC1[nWord] | vfCompositeLayerCC2[nWord];
-                        }
-                    }
-                    else if (nLayerExtendedSeq < nBiTwinCC1Layers)
-                    {
-                        for (unsigned int nWord = nExtMinWord; nWord < nMaxWord; nWord++)
-                        {
-                            vfExtCC1[nWord] |= vfCompositeLayerCC1[nWord];
-                            vfExtCC2[nWord] |= vfCompositeLayerCC2[nWord];
-                            vfExtTWN[nWord] |= vfCompositeLayerCC1[nWord];
-                        }
-                    }
-                    else
-                    {
-                        for (unsigned int nWord = nExtMinWord; nWord < nMaxWord; nWord++)
-                        {
-                            vfExtCC1[nWord] |= vfCompositeLayerCC1[nWord];
-                            vfExtCC2[nWord] |= vfCompositeLayerCC2[nWord];
-                        }
-                    }
-                }
-            }
+        // The extensions only use the second half, the primary sieve is
+        // applied on its own below it
+        CombineLayerSetsFunc combineLayerSets = (nArrayStride == 1) ? SieveCombineLayerSets : SieveCombineLayerSetsInterleaved;
+        if (nPrimaryMaxWord > nMinWord)
+        {
+            const unsigned int nPrimaryBoth = (nLayerSeq < nBiTwinCC2Layers);
+            const unsigned int nPrimaryCC1 = (nLayerSeq >= nBiTwinCC2Layers && nLayerSeq < nBiTwinCC1Layers);
+            combineLayerSets(&vSets[nExtSets], nPrimaryBoth, nPrimaryCC1, 1, vfCompositeLayerCC1, vfCompositeLayerCC2, nMinWord, nPrimaryMaxWord);
         }
+        if (nExtSets > 0)
+            combineLayerSets(vSets, nBoth, nCC1, nSets, vfCompositeLayerCC1, vfCompositeLayerCC2, std::max(nPrimaryMaxWord, nExtMinWord), nMaxWord);
+    }
 
-        // Combine the bitsets
-        // vfCandidates = ~(vfCompositeCunningham1 & vfCompositeCunningham2 & vfCompositeBiTwin)
-        for (unsigned int i = nMinWord; i < nMaxWord; i++)
-            vfCandidates[i] = ~(vfCompositeCunningham1[i] & vfCompositeCunningham2[i] & vfCompositeBiTwin[i]);
+    // Combine the bitsets
+    // vfCandidates = ~(vfCompositeCunningham1 & vfCompositeCunningham2 & vfCompositeBiTwin)
+    if (nArrayStride == 1)
+        SieveCombineCandidates(vfCandidates, vfCompositeCunningham1, vfCompositeCunningham2, vfCompositeBiTwin, nMinWord, nMaxWord);
+    else
+        SieveCombineCandidatesInterleaved(vfCandidates, nMinWord, nMaxWord);
 
-        // Combine the extended bitsets
-        for (unsigned int j = 0; j < nSieveExtensions; j++)
-            for (unsigned int i = nExtMinWord; i < nMaxWord; i++)
-                vfExtendedCandidates[j * nCandidatesWords + i] = ~(
-                    vfExtendedCompositeCunningham1[j * nCandidatesWords + i] &
-                    vfExtendedCompositeCunningham2[j * nCandidatesWords + i] &
-                    vfExtendedCompositeBiTwin[j * nCandidatesWords + i]);
+    // Combine the extended bitsets
+    for (unsigned int j = 0; j < nSieveExtensions; j++)
+    {
+        if (nArrayStride == 1)
+            SieveCombineCandidates(GetExtendedArray(vfExtendedCandidates, j),
+                GetExtendedArray(vfExtendedCompositeCunningham1, j),
+                GetExtendedArray(vfExtendedCompositeCunningham2, j),
+                GetExtendedArray(vfExtendedCompositeBiTwin, j),
+                nExtMinWord, nMaxWord);
+        else
+            SieveCombineCandidatesInterleaved(GetExtendedArray(vfExtendedCandidates, j), nExtMinWord, nMaxWord);
     }
 
-    // The sieve has been partially weaved
-    this->nPrimeSeq = nPrimes - 1;
+    return true;
+}
 
-    return false;
+// Weave a segment with the instance of WeaveSegmentLayers picked by Reset
+bool CSieveOfEratosthenes::WeaveSegment(ThreadWorkManager *pwmanager, unsigned int nSegment)
+{
+    return (this->*pWeaveSegment)(pwmanager, nSegment);
+}
+
+#define WEAVE_SEGMENT_EXTENSIONS(L) \
+    { &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 0>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 1>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 2>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 3>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 4>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 5>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 6>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 7>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 8>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 9>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 10>, &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 11>, \
+      &CSieveOfEratosthenes::WeaveSegmentLayers<true, L, 12> }
+
+CSieveOfEratosthenes::WeaveSegmentFunc CSieveOfEratosthenes::GetWeaveSegmentFunc(unsigned int nChainLength, unsigned int nSieveExtensions)
+{
+    static const WeaveSegmentFunc vFixedFuncs[nMaxFixedWeaveChainLength - nMinFixedWeaveChainLength + 1][nMaxFixedWeaveExtensions + 1] =
+    {
+        WEAVE_SEGMENT_EXTENSIONS(9),
+        WEAVE_SEGMENT_EXTENSIONS(10),
+        WEAVE_SEGMENT_EXTENSIONS(11),
+        WEAVE_SEGMENT_EXTENSIONS(12)
+    };
+    if (nChainLength >= nMinFixedWeaveChainLength && nChainLength <= nMaxFixedWeaveChainLength && nSieveExtensions <= nMaxFixedWeaveExtensions)
+        return vFixedFuncs[nChainLength - nMinFixedWeaveChainLength][nSieveExtensions];
+    return &CSieveOfEratosthenes::WeaveSegmentLayers<false, 0, 0>;
 }
 
+#undef WEAVE_SEGMENT_EXTENSIONS
+#undef WEAVE_UNROLL
+
 static const double dLogTwo = log(2.0);
 static const double dLogOneAndHalf = log(1.5);
 
+// Number of primes to weave each layer of a sieve with
+//
+// Every layer is weaved with all the filter primes by default. With
+// -sievelayerprimes=auto the depth of a layer follows the number of
+// candidates it filters: layer n filters the whole primary sieve if n is
+// below the chain length and the upper half of every extension i with
+// i < n <= i + chain length. A prime p marks about 1/p of the candidates
+// of those parts, while the large primes mostly cost a fixed amount per
+// prime and layer, so a layer filtering fewer candidates is weaved up to
+// a proportionally smaller prime.
+void GetSieveLayerPrimes(unsigned int nChainLength, unsigned int nSieveExtensions, unsigned int nSieveFilterPrimes, std::vector<unsigned int>& vLayerPrimes, const std::vector<unsigned int>& vPrimes)
+{
+    const unsigned int nSieveLayers = nChainLength + nSieveExtensions;
+    vLayerPrimes.assign(nSieveLayers, nSieveFilterPrimes);
+    if (fSieveLayerPrimesAuto)
+    {
+        // Weights in halves of the sieve
+        std::vector<unsigned int> vWeights(nSieveLayers, 0);
+        unsigned int nMaxWeight = 0;
+        for (unsigned int nLayerSeq = 0; nLayerSeq < nSieveLayers; nLayerSeq++)
+        {
+            if (nLayerSeq < nChainLength)
+                vWeights[nLayerSeq] += 2;
+            for (unsigned int nExtensionSeq = 0; nExtensionSeq < nSieveExtensions; nExtensionSeq++)
+            {
+                if (nLayerSeq >= nExtensionSeq + 1 && nLayerSeq < nChainLength + nExtensionSeq + 1)
+                    vWeights[nLayerSeq]++;
+            }
+            nMaxWeight = std::max(nMaxWeight, vWeights[nLayerSeq]);
+        }
+        const unsigned int nMaxPrime = vPrimes[nSieveFilterPrimes - 1];
+        for (unsigned int nLayerSeq = 0; nLayerSeq < nSieveLayers; nLayerSeq++)
+        {
+            const unsigned int nLayerMaxPrime = (unsigned int)((uint64)nMaxPrime * vWeights[nLayerSeq] / nMaxWeight);
+            const unsigned int nLayerPrimes = std::upper_bound(vPrimes.begin(), vPrimes.begin() + nSieveFilterPrimes, nLayerMaxPrime) - vPrimes.begin();
+            vLayerPrimes[nLayerSeq] = std::max(nLayerPrimes, std::min(nMinSieveFilterPrimes, nSieveFilterPrimes));
+        }
+    }
+    else if (!vSieveLayerPrimes.empty())
+    {
+        for (unsigned int nLayerSeq = 0; nLayerSeq < nSieveLayers; nLayerSeq++)
+            vLayerPrimes[nLayerSeq] = std::min(vSieveLayerPrimes[std::min(nLayerSeq, (unsigned int)vSieveLayerPrimes.size() - 1)], nSieveFilterPrimes);
+    }
+}
+
 // Estimate the probability of primality for a number in a candidate chain
-double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol)
+double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nChainLength, unsigned int nMiningProtocol, const CSieveParameters& params)
 {
     // h * q# / r# * s is prime with probability 1/log(h * q# / r# * s),
     //   (prime number theorem)
@@ -1263,8 +1914,17 @@ double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsi
     // statistically independent after running the sieve, which might not be
     // true, but nontheless it's a reasonable model of the chances of finding
     // prime chains.
-    const unsigned int nSieveWeaveOptimalPrime = vPrimes[nSieveFilterPrimes - 1];
-    const unsigned int nAverageCandidateMultiplier = nSieveSize / 2;
+    //
+    // The chain member is found in layer nChainPrimeNum of the primary sieve
+    // and in layer nChainPrimeNum + i + 1 of extension i, log(p) is averaged
+    // over the candidates of the parts.
+    std::vector<unsigned int> vLayerPrimes;
+    GetSieveLayerPrimes(std::max(nChainLength, nChainPrimeNum + 1), params.nSieveExtensions, params.nSieveFilterPrimes, vLayerPrimes, vPrimes);
+    double dLogWeavePrimeSum = 2.0 * log((double)vPrimes[vLayerPrimes[nChainPrimeNum] - 1]);
+    for (unsigned int i = 0; i < params.nSieveExtensions; i++)
+        dLogWeavePrimeSum += log((double)vPrimes[vLayerPrimes[nChainPrimeNum + i + 1] - 1]);
+    const double dLogWeavePrime = dLogWeavePrimeSum / (2 + params.nSieveExtensions);
+    const unsigned int nAverageCandidateMultiplier = params.nSieveSize / 2;
     double dFixedMultiplier = 1.0;
     for (unsigned int i = 0; vPrimes[i] <= nPrimorialMultiplier; i++)
         dFixedMultiplier *= vPrimes[i];
@@ -1274,22 +1934,22 @@ double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsi
             dFixedMultiplier /= vPrimes[i];
     }
 
-    double dExtendedSieveWeightedSum = 0.5 * nSieveSize;
-    double dExtendedSieveCandidates = nSieveSize;
-    for (unsigned int i = 0; i < nSieveExtensions; i++)
+    double dExtendedSieveWeightedSum = 0.5 * params.nSieveSize;
+    double dExtendedSieveCandidates = params.nSieveSize;
+    for (unsigned int i = 0; i < params.nSieveExtensions; i++)
     {
-        dExtendedSieveWeightedSum += 0.75 * (nSieveSize * (2 << i));
-        dExtendedSieveCandidates += nSieveSize / 2;
+        dExtendedSieveWeightedSum += 0.75 * ldexp((double)params.nSieveSize, i + 1);
+        dExtendedSieveCandidates += params.nSieveSize / 2;
     }
     const double dExtendedSieveAverageMultiplier = dExtendedSieveWeightedSum / dExtendedSieveCandidates;
 
-    return (1.781072 * log((double)std::max(1u, nSieveWeaveOptimalPrime)) / (255.0 * dLogTwo + dLogOneAndHalf + log(dFixedMultiplier) + log(nAverageCandidateMultiplier) + dLogTwo * nChainPrimeNum + log(dExtendedSieveAverageMultiplier)));
+    return (1.781072 * dLogWeavePrime / (255.0 * dLogTwo + dLogOneAndHalf + log(dFixedMultiplier) + log(nAverageCandidateMultiplier) + dLogTwo * nChainPrimeNum + log(dExtendedSieveAverageMultiplier)));
 }
 
 // Esimate the prime probablity of numbers that haven't been sieved
-double EstimateNormalPrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol)
+double EstimateNormalPrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol, const CSieveParameters& params)
 {
-    const unsigned int nAverageCandidateMultiplier = nSieveSize / 2;
+    const unsigned int nAverageCandidateMultiplier = params.nSieveSize / 2;
     double dFixedMultiplier = 1.0;
     for (unsigned int i = 0; vPrimes[i] <= nPrimorialMultiplier; i++)
         dFixedMultiplier *= vPrimes[i];
@@ -1299,12 +1959,12 @@ double EstimateNormalPrimeProbability(unsigned int nPrimorialMultiplier, unsigne
             dFixedMultiplier /= vPrimes[i];
     }
 
-    double dExtendedSieveWeightedSum = 0.5 * nSieveSize;
-    double dExtendedSieveCandidates = nSieveSize;
-    for (unsigned int i = 0; i < nSieveExtensions; i++)
+    double dExtendedSieveWeightedSum = 0.5 * params.nSieveSize;
+    double dExtendedSieveCandidates = params.nSieveSize;
+    for (unsigned int i = 0; i < params.nSieveExtensions; i++)
     {
-        dExtendedSieveWeightedSum += 0.75 * (nSieveSize * (2 << i));
-        dExtendedSieveCandidates += nSieveSize / 2;
+        dExtendedSieveWeightedSum += 0.75 * ldexp((double)params.nSieveSize, i + 1);
+        dExtendedSieveCandidates += params.nSieveSize / 2;
     }
     const double dExtendedSieveAverageMultiplier = dExtendedSieveWeightedSum / dExtendedSieveCandidates;
 
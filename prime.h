@@ -9,8 +9,10 @@
 
 #include <gmp.h>
 #include <gmpxx.h>
+#include <algorithm>
 #include <bitset>
 #include <boost/timer/timer.hpp>
+#include "allocators.h"
 #include "block.h"
 #include "workmanager.h"
 
@@ -19,16 +21,37 @@
 /**********************/
 
 extern std::vector<unsigned int> vPrimes;
-static const unsigned int nMaxSieveExtensions = 20;
+
+// Constants of the primes in the prime table
+// The arrays are indexed by the prime sequence like vPrimes. They are built
+// once in GeneratePrimeTable() and only read afterwards so all the sieves on
+// a NUMA node share them, see GetNodePrimeTables().
+struct CPrimeConstants
+{
+    std::vector<unsigned int> vReciprocals; // floor(2^32 / p) for DivideByPrime()
+    std::vector<unsigned char> vRotateBits; // p mod bits of a sieve word
+
+    // Groups of consecutive primes whose product fits in 32 bits
+    std::vector<unsigned int> vGroupStart; // first prime of each group and the end of the last group
+    std::vector<unsigned int> vGroupProducts;
+    std::vector<uint64> vGroupReciprocals; // floor((2^64 - 1) / product) for Barrett reduction
+};
+extern CPrimeConstants primeConstants;
+
+// Get the copies of vPrimes and primeConstants in the memory of a NUMA node,
+// the copies are made by the first thread bound to the node that asks
+void GetNodePrimeTables(unsigned int nNode, const std::vector<unsigned int>*& pvPrimes, const CPrimeConstants*& pConstants);
+
+static const unsigned int nMaxSieveExtensions = 32;
 static const unsigned int nMinSieveExtensions = 0;
 static const unsigned int nDefaultSieveExtensions = 9;
 static const unsigned int nDefaultSieveExtensionsTestnet = 4;
 extern unsigned int nSieveExtensions;
-static const unsigned int nMaxSieveFilterPrimes = 78498u; // size of prime table
+static const unsigned int nMaxSieveFilterPrimes = 1000000u; // primes below ~15.5 million
 static const unsigned int nDefaultSieveFilterPrimes = 7849u;
 static const unsigned int nMinSieveFilterPrimes = 1000u;
 extern unsigned int nSieveFilterPrimes;
-static const unsigned int nMaxSieveSize = 10000000u;
+static const unsigned int nMaxSieveSize = 100000000u;
 static const unsigned int nDefaultSieveSize = 917504u;
 static const unsigned int nMinSieveSize = 100000u;
 extern unsigned int nSieveSize;
@@ -36,6 +59,16 @@ static const unsigned int nMaxL1CacheSize = 128000u;
 static const unsigned int nDefaultL1CacheSize = 28672u;
 static const unsigned int nMinL1CacheSize = 12000u;
 extern unsigned int nL1CacheSize;
+extern unsigned int nL2CacheSize; // 0 for L1 cache sized segments
+static const unsigned int nMaxSieveThreads = 64u;
+static const unsigned int nDefaultSieveThreads = 1u;
+static const unsigned int nMinSieveThreads = 1u;
+extern unsigned int nSieveThreads;
+extern bool fSieveInterleave;
+extern bool fSieveHugePages;
+extern bool fSieveCompactMultipliers; // keep the multipliers of the primes below 2^16 in 16 bits
+extern bool fSieveLayerPrimesAuto; // derive the primes of each layer from its weight
+extern std::vector<unsigned int> vSieveLayerPrimes; // configured primes of each layer
 static const uint256 hashBlockHeaderLimit = (uint256(1) << 255);
 static const CBigNum bnOne = 1;
 static const CBigNum bnPrimeMax = (bnOne << 2000) - 1;
@@ -145,11 +178,31 @@ std::string GetPrimeOriginPrimorialForm(CBigNum& bnPrimeChainOrigin);
 /* PRIMECOIN MINING */
 /********************/
 
+// Sieve parameters used by a miner thread for a round
+// The globals above keep the configured values, with -autotune the threads
+// get the tuned values as a consistent copy from CSieveAutoTuner::BeginRound()
+struct CSieveParameters
+{
+    unsigned int nSetting; // autotuner setting the values belong to
+    unsigned int nSieveSize;
+    unsigned int nSieveFilterPrimes;
+    unsigned int nSieveExtensions;
+    unsigned int nL1CacheSize;
+    int nSieveTargetLength;
+};
+
 class CSieveOfEratosthenes;
 class CPrimalityTestParams;
+class CSieveGroup;
 
 // Mine probable prime chain of form: n = h * p# +/- 1
-bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength], CSieveOfEratosthenes& sieve, CPrimalityTestParams& testParams);
+// pgroup: optional group of threads sharing the sieve (pgroup->sieve)
+bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength], CSieveOfEratosthenes& sieve, CPrimalityTestParams& testParams, CSieveGroup *pgroup = NULL);
+// Weave and test the sieve published by the leader of a sieve group
+// Return values:
+//   true - Probable prime chain found; winfo has the multiplier
+//   false - sieve depleted or replaced by the leader
+bool MineProbablePrimeChainGroup(CSieveGroup& group, unsigned int nGeneration, WorkInfo& winfo, CPrimalityTestParams& testParams);
 
 
 // Perform Fermat test with trial division
@@ -158,10 +211,13 @@ bool MineProbablePrimeChain(ThreadWorkManager &workmanager, WorkInfo& winfo, uns
 //   false - failed either trial division or Fermat test; composite
 bool ProbablePrimalityTestWithTrialDivision(const mpz_class& mpzCandidate, unsigned int nTrialDivisionLimit, CPrimalityTestParams& testParams);
 
+// Number of primes to weave each layer of a sieve with
+// vPrimes is the global table or the copy of the caller's NUMA node
+void GetSieveLayerPrimes(unsigned int nChainLength, unsigned int nSieveExtensions, unsigned int nSieveFilterPrimes, std::vector<unsigned int>& vLayerPrimes, const std::vector<unsigned int>& vPrimes);
 // Estimate the probability of primality for a number in a candidate chain
-double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol);
+double EstimateCandidatePrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nChainLength, unsigned int nMiningProtocol, const CSieveParameters& params);
 // Esimate the prime probablity of numbers that haven't been sieved
-double EstimateNormalPrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol);
+double EstimateNormalPrimeProbability(unsigned int nPrimorialMultiplier, unsigned int nChainPrimeNum, unsigned int nMiningProtocol, const CSieveParameters& params);
 
 /*
  * Use GCC-style builtin functions such as
@@ -202,6 +258,55 @@ inline sieve_word_t rotate_left(sieve_word_t bits, unsigned int count)
 }
 #endif
 
+// Words of one index in the interleaved layout of the sieve arrays
+// With -sieveinterleave the candidate and composite words of an index are
+// stored next to each other, so combining the layers and classifying a
+// candidate touch a single cache line instead of four separate arrays.
+enum
+{
+    SIEVE_WORD_CANDIDATES = 0,
+    SIEVE_WORD_BITWIN = 1,
+    SIEVE_WORD_CC1 = 2,
+    SIEVE_WORD_CC2 = 3,
+    SIEVE_INTERLEAVED_WORDS = 4,
+};
+
+// Get the index of the lowest set bit of a non-zero word
+inline unsigned int CountTrailingZeros(sieve_word_t bits)
+{
+#ifdef USE_GCC_BUILTINS
+    return __builtin_ctzll(bits);
+#else
+    unsigned int count = 0;
+    for (; !(bits & 1); bits >>= 1)
+        count++;
+    return count;
+#endif
+}
+
+// Divide by a prime with its reciprocal floor(2^32 / nPrime)
+inline unsigned int DivideByPrime(unsigned int n, unsigned int nPrime, unsigned int nReciprocal)
+{
+    // The estimated quotient is at most one too small
+    unsigned int nQuotient = ((uint64)n * nReciprocal) >> 32;
+    if (n - nQuotient * nPrime >= nPrime)
+        nQuotient++;
+    return nQuotient;
+}
+
+// Multiply by 2^-1 modulo an odd prime
+inline unsigned int HalveModPrime(unsigned int n, unsigned int nPrime)
+{
+    return (n & 1) ? (n >> 1) + (nPrime >> 1) + 1 : n >> 1;
+}
+
+// Candidate drained from the sieve
+struct CSieveCandidate
+{
+    uint64 nMultiplier; // variable part of the multiplier
+    unsigned int nCandidateType; // chain type not ruled out by the sieve
+};
+
 class CPrimalityTestParams
 {
 public:
@@ -220,15 +325,22 @@ public:
     // Values specific to a round
     unsigned int nBits;
     unsigned int nCandidateType;
+    CSieveParameters sieveParams;
 
     // Results
     unsigned int nChainLength;
 
+    // Candidates drained from the sieve and the next one to be tested
+    std::vector<CSieveCandidate> vCandidates;
+    unsigned int nCandidateNext;
+
     CPrimalityTestParams()
     {
         nBits = 0;
         nCandidateType = 0;
+        sieveParams = CSieveParameters();
         nChainLength = 0;
+        nCandidateNext = 0;
         mpz_init(mpzE);
         mpz_init(mpzR);
         mpz_init(mpzRplusOne);
@@ -242,6 +354,23 @@ public:
     }
 };
 
+// Next multipliers of a prime in a layer of the sieve, compact version
+// The offsets are relative to the start of the next range of the layer to
+// be weaved. Offsets of nCompactMultiplierNone mean that the prime divides
+// the fixed factor.
+// The layout (-sievecompact) halves the multipliers of the primes below
+// 2^16. It shortens the weave by a few percent at the default sieve size and
+// filter primes, with or without -sievethreads, but does nothing for large
+// sieves or filter prime counts where most primes are above 2^16. Turn it on
+// only with such default sized sieves, and keep it if block/s improves.
+struct CCompactMultipliers
+{
+    unsigned short nOffsetCC1;
+    unsigned short nOffsetCC2;
+};
+static const unsigned int nCompactMultiplierNone = 0xFFFF;
+static const unsigned int nMaxCompactPrime = 0xFFFF; // larger than the largest offset
+
 // Sieve of Eratosthenes for proof-of-work mining
 //
 // Includes the sieve extension feature from jhPrimeminer by jh000
@@ -259,6 +388,12 @@ public:
 // The larger numbers in the extensions have a slightly smaller probability of
 // being primes and take slightly longer to test but they can be calculated very
 // efficiently because the layers overlap.
+//
+// Every multiplier index is kept in the arrays. The fixed factor
+// hash * fixed_multiplier is divisible by all the primes up to the primorial,
+// so those never divide a chain member. The multipliers marked by any other
+// prime depend on the inverse of the fixed factor and change with every nonce,
+// which leaves no fixed wheel to compress the index space with.
 class CSieveOfEratosthenes
 {
     unsigned int nSieveSize; // size of the sieve
@@ -269,7 +404,20 @@ class CSieveOfEratosthenes
     mpz_class mpzFixedMultiplier; // fixed round multiplier
     mpz_class mpzHashFixedMult; // mpzHash * mpzFixedMultiplier
 
+    // prime table and constants on the NUMA node of the sieve
+    const std::vector<unsigned int> *pvPrimes;
+    const CPrimeConstants *pPrimeConstants;
+
+    // All the arrays below are carved out of a single cache line aligned
+    // arena that is only reallocated when the parameters change
+    static const size_t nArenaAlignment = 64;
+    unsigned char *pArena;
+    size_t nArenaBytes;
+    void *pArenaAllocation;
+
     // final set of candidates for probable primality checking
+    // In the interleaved layout the arrays point into the candidates array
+    // and word i of each array is at index i * nArrayStride.
     sieve_word_t *vfCandidates;
     sieve_word_t *vfCompositeBiTwin;
     sieve_word_t *vfCompositeCunningham1;
@@ -278,36 +426,70 @@ class CSieveOfEratosthenes
     sieve_word_t *vfCompositeLayerCC2;
 
     // extended sets
+    // Only the second half of an extension is used, so each extension keeps
+    // nExtendedWords words starting at word nExtendedMinWord of the sieve.
+    // Use GetExtendedArray() to index them by the word number of the sieve.
     sieve_word_t *vfExtendedCandidates;
     sieve_word_t *vfExtendedCompositeBiTwin;
     sieve_word_t *vfExtendedCompositeCunningham1;
     sieve_word_t *vfExtendedCompositeCunningham2;
 
     // divisible multipliers
+    // With -sievecompact the primes below nCompactPrimeSeq are kept in
+    // vCompactMultipliers and the arrays below start at nCompactPrimeSeq.
+    CCompactMultipliers *vCompactMultipliers;
     unsigned int *vCunningham1Multipliers;
     unsigned int *vCunningham2Multipliers;
 
+    // inverses of the fixed factor modulo each prime
+    std::vector<unsigned int> vFixedInverses;
+
+    // number of primes weaved in each layer, at most nPrimes
+    std::vector<unsigned int> vLayerPrimes;
+
+    // bucket sieve: multipliers hit by the large primes, per segment and layer
+    std::vector<std::vector<unsigned int> > vCunningham1Buckets;
+    std::vector<std::vector<unsigned int> > vCunningham2Buckets;
+
     static const unsigned int nWordBits = 8 * sizeof(sieve_word_t);
     unsigned int nCandidatesWords;
     unsigned int nCandidatesBytes;
+    unsigned int nExtendedMinWord; // first word stored in the extensions
+    unsigned int nExtendedWords; // number of words stored for each extension
+    unsigned int nArrayStride; // 1 or SIEVE_INTERLEAVED_WORDS
 
-    unsigned int nPrimeSeq; // prime sequence number currently being processed
-    unsigned int nCandidateCount; // cached total count of candidates
-    unsigned int nCandidateMultiplier; // current candidate for power test
     unsigned int nCandidateIndex; // internal candidate index
+    unsigned int nCandidateSegment; // segment being scanned for candidates
+    unsigned int nCandidateSegmentsReady; // segments known to be weaved
     bool fCandidateIsExtended; // is the current candidate in the extended part
     unsigned int nCandidateActiveExtension; // which extension is active
 
     unsigned int nChainLength; // target chain length
     unsigned int nSieveLayers; // sieve layers
     unsigned int nPrimes; // number of times to weave the sieve
+    unsigned int nChunkPrimeSeq; // first prime larger than an L1 cache sized chunk
+    unsigned int nBucketPrimeSeq; // first prime larger than a segment
+    unsigned int nCompactPrimeSeq; // first prime without compact multipliers
     unsigned int nL1CacheElements; // number of bits that can be stored in L1 cache
+    unsigned int nSegmentElements; // number of bits in a segment, whole L1 chunks
+    unsigned int nSegments; // number of L2 cache sized segments
+
+    // cooperative weaving
+    volatile unsigned int nSegmentNext; // next segment to be claimed
+    volatile unsigned int nSegmentsDone; // number of leading completed segments
+    std::vector<bool> vfSegmentDone; // completed segments, guarded by csSegments
+    bool fSharedWeave; // segments may be weaved by several threads
+    boost::mutex csSegments;
 
     // previous parameters
     unsigned int nCandidatesBytesPrev;
+    unsigned int nArrayStridePrev;
     unsigned int nSieveExtensionsPrev;
+    unsigned int nExtendedWordsPrev;
     unsigned int nMultiplierBytesPrev;
+    unsigned int nCompactBytesPrev;
 
+    bool fHugePages; // arena is allocated with AllocateHugePages
     bool fIsReady;
     bool fIsDepleted;
 
@@ -319,34 +501,93 @@ class CSieveOfEratosthenes
         return (sieve_word_t)1 << (nBitNum % nWordBits);
     }
 
-    void ProcessMultiplier(sieve_word_t *vfComposites, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int *vMultipliers, unsigned int nLayerSeq);
+    void ProcessMultiplier(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int nLayerSeq);
+    void ProcessPrimes(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, const unsigned int nMinMultiplier, const unsigned int nMaxMultiplier, const std::vector<unsigned int>& vPrimes, unsigned int nLayerSeq, unsigned int nMinPrimeSeq, unsigned int nMaxPrimeSeq);
+    void ProcessBucket(sieve_word_t *vfComposites, const std::vector<unsigned int>& vBucket);
+    void MarkMultipliers(sieve_word_t *vfCompositesCC1, sieve_word_t *vfCompositesCC2, unsigned int& nMultiplierCC1, unsigned int& nMultiplierCC2, const unsigned int nMaxMultiplier, const unsigned int nPrime, const unsigned int nPrimeSeq);
+
+    // Index of a prime and layer in vCunningham1Multipliers and vCunningham2Multipliers
+    unsigned int GetMultiplierIndex(unsigned int nPrimeSeq, unsigned int nLayerSeq)
+    {
+        return (nPrimeSeq - nCompactPrimeSeq) * nSieveLayers + nLayerSeq;
+    }
+
+    // First multiplier weaved in a layer
+    unsigned int GetLayerMinMultiplier(unsigned int nLayerSeq)
+    {
+        return (nLayerSeq < nChainLength) ? 0 : nSieveSize / 2;
+    }
+
+    // WeaveSegment with the chain length and the number of extensions fixed
+    // at compile time if fFixed, so the loops over the layers and extensions
+    // are unrolled and the tests of the layer ranges are folded away
+    template<bool fFixed, unsigned int ChainLength, unsigned int Extensions>
+    bool WeaveSegmentLayers(ThreadWorkManager *pwmanager, unsigned int nSegment);
+    typedef bool (CSieveOfEratosthenes::*WeaveSegmentFunc)(ThreadWorkManager *pwmanager, unsigned int nSegment);
+    WeaveSegmentFunc pWeaveSegment; // instance of WeaveSegmentLayers for the current parameters
+    static WeaveSegmentFunc GetWeaveSegmentFunc(unsigned int nChainLength, unsigned int nSieveExtensions);
+
+    // File every multiplier of a large prime into the bucket of its segment
+    void FillBuckets(std::vector<std::vector<unsigned int> >& vBuckets, unsigned int nMultiplier, const unsigned int nPrime, const unsigned int nReciprocal, const unsigned int nLayerSeq)
+    {
+        // First halves of the arrays are not needed in the extensions
+        const unsigned int nMinMultiplier = GetLayerMinMultiplier(nLayerSeq);
+        if (nMultiplier < nMinMultiplier)
+            nMultiplier += DivideByPrime(nMinMultiplier - nMultiplier + nPrime - 1, nPrime, nReciprocal) * nPrime;
+        for (; nMultiplier < nSieveSize; nMultiplier += nPrime)
+            vBuckets[nMultiplier / nSegmentElements * nSieveLayers + nLayerSeq].push_back(nMultiplier);
+    }
+
+    // Array of an extension indexed by the word number of the sieve
+    // The words below nExtendedMinWord are not stored, the pointer is moved
+    // back over them into the arrays carved before it from the arena.
+    sieve_word_t *GetExtendedArray(sieve_word_t *vfExtended, unsigned int nExtensionSeq) const
+    {
+        return vfExtended + ((ptrdiff_t)nExtensionSeq * nExtendedWords - (ptrdiff_t)nExtendedMinWord) * (ptrdiff_t)nArrayStride;
+    }
+
+    // Size of an array rounded up to whole cache lines of the arena
+    static size_t GetArenaBytes(size_t nBytes)
+    {
+        return (nBytes + nArenaAlignment - 1) / nArenaAlignment * nArenaAlignment;
+    }
+
+    // Allocate the arena, backed by huge pages with -hugepages
+    void allocArena(size_t nBytes)
+    {
+        nArenaBytes = nBytes;
+        if (fHugePages)
+        {
+            pArenaAllocation = AllocateHugePages(nBytes);
+            pArena = (unsigned char *)pArenaAllocation;
+        }
+        else
+        {
+            pArenaAllocation = malloc(nBytes + nArenaAlignment - 1);
+            pArena = (unsigned char *)((reinterpret_cast<size_t>(pArenaAllocation) + nArenaAlignment - 1) & ~(size_t)(nArenaAlignment - 1));
+        }
+    }
+
+    // Take the next nBytes of the arena, nBytes must be a multiple of the alignment
+    void *carveArray(unsigned char *&pNext, size_t nBytes)
+    {
+        void *p = pNext;
+        pNext += nBytes;
+        return p;
+    }
 
     void freeArrays()
     {
-        if (vfCandidates)
-            free(vfCandidates);
-        if (vfCompositeBiTwin)
-            free(vfCompositeBiTwin);
-        if (vfCompositeCunningham1)
-            free(vfCompositeCunningham1);
-        if (vfCompositeCunningham2)
-            free(vfCompositeCunningham2);
-        if (vfCompositeLayerCC1)
-            free(vfCompositeLayerCC1);
-        if (vfCompositeLayerCC2)
-            free(vfCompositeLayerCC2);
-        if (vfExtendedCandidates)
-            free(vfExtendedCandidates);
-        if (vfExtendedCompositeBiTwin)
-            free(vfExtendedCompositeBiTwin);
-        if (vfExtendedCompositeCunningham1)
-            free(vfExtendedCompositeCunningham1);
-        if (vfExtendedCompositeCunningham2)
-            free(vfExtendedCompositeCunningham2);
-        if (vCunningham1Multipliers)
-            free(vCunningham1Multipliers);
-        if (vCunningham2Multipliers)
-            free(vCunningham2Multipliers);
+        if (pArenaAllocation)
+        {
+            if (fHugePages)
+                FreeHugePages(pArenaAllocation, nArenaBytes);
+            else
+                free(pArenaAllocation);
+        }
+        pArenaAllocation = NULL;
+        pArena = NULL;
+        nArenaBytes = 0;
         vfCandidates = NULL;
         vfCompositeBiTwin = NULL;
         vfCompositeCunningham1 = NULL;
@@ -357,6 +598,9 @@ class CSieveOfEratosthenes
         vfExtendedCompositeBiTwin = NULL;
         vfExtendedCompositeCunningham1 = NULL;
         vfExtendedCompositeCunningham2 = NULL;
+        vCompactMultipliers = NULL;
+        vCunningham1Multipliers = NULL;
+        vCunningham2Multipliers = NULL;
     }
 
 public:
@@ -369,6 +613,12 @@ public:
         mpzHash = 0;
         mpzFixedMultiplier = 0;
         mpzHashFixedMult = 0;
+        pvPrimes = &vPrimes;
+        pPrimeConstants = &primeConstants;
+        pWeaveSegment = NULL;
+        pArena = NULL;
+        nArenaBytes = 0;
+        pArenaAllocation = NULL;
         vfCandidates = NULL;
         vfCompositeBiTwin = NULL;
         vfCompositeCunningham1 = NULL;
@@ -379,23 +629,37 @@ public:
         vfExtendedCompositeBiTwin = NULL;
         vfExtendedCompositeCunningham1 = NULL;
         vfExtendedCompositeCunningham2 = NULL;
+        vCompactMultipliers = NULL;
         vCunningham1Multipliers = NULL;
         vCunningham2Multipliers = NULL;
         nCandidatesWords = 0;
         nCandidatesBytes = 0;
+        nExtendedMinWord = 0;
+        nExtendedWords = 0;
+        nArrayStride = 1;
         nCandidatesBytesPrev = 0;
+        nArrayStridePrev = 1;
+        fHugePages = false;
         nSieveExtensionsPrev = 0;
+        nExtendedWordsPrev = 0;
         nMultiplierBytesPrev = 0;
-        nPrimeSeq = 0;
-        nCandidateCount = 0;
-        nCandidateMultiplier = 0;
+        nCompactBytesPrev = 0;
         nCandidateIndex = 0;
+        nCandidateSegment = 0;
+        nCandidateSegmentsReady = 0;
         fCandidateIsExtended = false;
         nCandidateActiveExtension = 0;
         nChainLength = 0;
         nSieveLayers = 0;
         nPrimes = 0;
+        nBucketPrimeSeq = 0;
+        nCompactPrimeSeq = 0;
         nL1CacheElements = 0;
+        nSegmentElements = 0;
+        nSegments = 0;
+        nSegmentNext = 0;
+        nSegmentsDone = 0;
+        fSharedWeave = false;
         fIsReady = false;
         fIsDepleted = true;
     }
@@ -405,244 +669,404 @@ public:
         freeArrays();
     }
 
-    void Reset(unsigned int nSieveSize, unsigned int nSieveFilterPrimes, unsigned int nSieveExtensions, unsigned int nL1CacheSize, unsigned int nBits, mpz_class& mpzHash, mpz_class& mpzFixedMultiplier)
+    // Read the prime tables from the memory of a NUMA node, called by a
+    // thread bound to the node
+    void SetNumaNode(unsigned int nNode)
     {
-        this->nSieveSize = nSieveSize;
-        this->nSieveFilterPrimes = nSieveFilterPrimes;
-        this->nSieveExtensions = nSieveExtensions;
-        nL1CacheElements = nL1CacheSize * 8;
+        GetNodePrimeTables(nNode, pvPrimes, pPrimeConstants);
+    }
+
+    void Reset(const CSieveParameters& params, unsigned int nL2CacheSize, unsigned int nBits, mpz_class& mpzHash, mpz_class& mpzFixedMultiplier)
+    {
+        nSieveSize = params.nSieveSize;
+        nSieveFilterPrimes = params.nSieveFilterPrimes;
+        nSieveExtensions = params.nSieveExtensions;
+        nL1CacheElements = params.nL1CacheSize * 8;
+
+        // A segment covers as many L1 sized chunks as the bit arrays of the
+        // segment can keep in the L2 cache
+        const unsigned int nBitArrays = 6 + 4 * nSieveExtensions;
+        nSegmentElements = std::max(1u, (unsigned int)((uint64)nL2CacheSize * 8 / nBitArrays / nL1CacheElements)) * nL1CacheElements;
+        nSegments = (nSieveSize + nSegmentElements - 1) / nSegmentElements;
+        nSegmentNext = 0;
+        nSegmentsDone = 0;
+        vfSegmentDone.assign(nSegments, false);
         this->nBits = nBits;
         this->mpzHash = mpzHash;
         this->mpzFixedMultiplier = mpzFixedMultiplier;
         mpzHashFixedMult = mpzHash * mpzFixedMultiplier;
-        nPrimeSeq = 0;
-        nCandidateCount = 0;
-        nCandidateMultiplier = 0;
-        nCandidateIndex = 0;
+        nCandidateIndex = 1; // zero is not a valid multiplier
+        nCandidateSegment = 0;
+        nCandidateSegmentsReady = 0;
         fCandidateIsExtended = false;
         nCandidateActiveExtension = 0;
         nCandidatesWords = (nSieveSize + nWordBits - 1) / nWordBits;
         nCandidatesBytes = nCandidatesWords * sizeof(sieve_word_t);
+        nExtendedMinWord = nSieveSize / 2 / nWordBits;
+        nExtendedWords = nCandidatesWords - nExtendedMinWord;
+        nArrayStride = fSieveInterleave ? SIEVE_INTERLEAVED_WORDS : 1;
         nChainLength = TargetGetLength(nBits);
 
         // Override target length if requested
-        if (nSieveTargetLength > 0)
-            nChainLength = nSieveTargetLength;
+        if (params.nSieveTargetLength > 0)
+            nChainLength = params.nSieveTargetLength;
         nSieveLayers = nChainLength + nSieveExtensions;
+        pWeaveSegment = GetWeaveSegmentFunc(nChainLength, nSieveExtensions);
 
         // Filter only a certain number of prime factors
         // Most composites are still found
-        nPrimes = nSieveFilterPrimes;
-        const unsigned int nMultiplierBytes = nPrimes * nSieveLayers * sizeof(unsigned int);
+        const std::vector<unsigned int>& vPrimes = *pvPrimes;
+        GetSieveLayerPrimes(nChainLength, nSieveExtensions, nSieveFilterPrimes, vLayerPrimes, vPrimes);
+        nPrimes = *std::max_element(vLayerPrimes.begin(), vLayerPrimes.end());
+
+        // Primes larger than a segment hit it at most once, so they are
+        // sieved with buckets and don't need the multiplier arrays
+        nChunkPrimeSeq = std::lower_bound(vPrimes.begin() + 1, vPrimes.begin() + nPrimes, nL1CacheElements) - vPrimes.begin();
+        nBucketPrimeSeq = std::lower_bound(vPrimes.begin() + 1, vPrimes.begin() + nPrimes, nSegmentElements) - vPrimes.begin();
+        nCompactPrimeSeq = 0;
+        if (fSieveCompactMultipliers)
+            nCompactPrimeSeq = std::lower_bound(vPrimes.begin(), vPrimes.begin() + nBucketPrimeSeq, nMaxCompactPrime) - vPrimes.begin();
+        const unsigned int nCompactBytes = nCompactPrimeSeq * nSieveLayers * sizeof(CCompactMultipliers);
+        const unsigned int nMultiplierBytes = (nBucketPrimeSeq - nCompactPrimeSeq) * nSieveLayers * sizeof(unsigned int);
 
         // Allocate arrays if parameters have changed
-        if (nCandidatesBytes != nCandidatesBytesPrev || nSieveExtensions != nSieveExtensionsPrev || nMultiplierBytes != nMultiplierBytesPrev)
+        const size_t nArrayBytes = GetArenaBytes(nCandidatesBytes);
+        const size_t nExtendedBytes = GetArenaBytes(nSieveExtensions * nExtendedWords * sizeof(sieve_word_t));
+        const size_t nBitArraysBytes = 6 * nArrayBytes + 4 * nExtendedBytes;
+        if (nCandidatesBytes != nCandidatesBytesPrev || nArrayStride != nArrayStridePrev || nSieveExtensions != nSieveExtensionsPrev || nExtendedWords != nExtendedWordsPrev || nMultiplierBytes != nMultiplierBytesPrev || nCompactBytes != nCompactBytesPrev || fHugePages != fSieveHugePages)
         {
+            freeArrays();
+            fHugePages = fSieveHugePages;
             nCandidatesBytesPrev = nCandidatesBytes;
+            nArrayStridePrev = nArrayStride;
             nSieveExtensionsPrev = nSieveExtensions;
+            nExtendedWordsPrev = nExtendedWords;
             nMultiplierBytesPrev = nMultiplierBytes;
-            freeArrays();
-            vfCandidates = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfCompositeBiTwin = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfCompositeCunningham1 = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfCompositeCunningham2 = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfCompositeLayerCC1 = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfCompositeLayerCC2 = (sieve_word_t *)malloc(nCandidatesBytes);
-            vfExtendedCandidates = (sieve_word_t *)malloc(nSieveExtensions * nCandidatesBytes);
-            vfExtendedCompositeBiTwin = (sieve_word_t *)malloc(nSieveExtensions * nCandidatesBytes);
-            vfExtendedCompositeCunningham1 = (sieve_word_t *)malloc(nSieveExtensions * nCandidatesBytes);
-            vfExtendedCompositeCunningham2 = (sieve_word_t *)malloc(nSieveExtensions * nCandidatesBytes);
-            vCunningham1Multipliers = (unsigned int *)malloc(nMultiplierBytes);
-            vCunningham2Multipliers = (unsigned int *)malloc(nMultiplierBytes);
+            nCompactBytesPrev = nCompactBytes;
+            allocArena(nBitArraysBytes + GetArenaBytes(nCompactBytes) + 2 * GetArenaBytes(nMultiplierBytes));
+
+            // Carve the arrays out of the arena
+            unsigned char *pNext = pArena;
+            if (nArrayStride == 1)
+            {
+                vfCandidates = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+                vfCompositeBiTwin = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+                vfCompositeCunningham1 = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+                vfCompositeCunningham2 = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+                vfExtendedCandidates = (sieve_word_t *)carveArray(pNext, nExtendedBytes);
+                vfExtendedCompositeBiTwin = (sieve_word_t *)carveArray(pNext, nExtendedBytes);
+                vfExtendedCompositeCunningham1 = (sieve_word_t *)carveArray(pNext, nExtendedBytes);
+                vfExtendedCompositeCunningham2 = (sieve_word_t *)carveArray(pNext, nExtendedBytes);
+            }
+            else
+            {
+                vfCandidates = (sieve_word_t *)carveArray(pNext, nArrayStride * nArrayBytes);
+                vfCompositeBiTwin = vfCandidates + SIEVE_WORD_BITWIN;
+                vfCompositeCunningham1 = vfCandidates + SIEVE_WORD_CC1;
+                vfCompositeCunningham2 = vfCandidates + SIEVE_WORD_CC2;
+                vfExtendedCandidates = (sieve_word_t *)carveArray(pNext, nArrayStride * nExtendedBytes);
+                vfExtendedCompositeBiTwin = vfExtendedCandidates + SIEVE_WORD_BITWIN;
+                vfExtendedCompositeCunningham1 = vfExtendedCandidates + SIEVE_WORD_CC1;
+                vfExtendedCompositeCunningham2 = vfExtendedCandidates + SIEVE_WORD_CC2;
+            }
+            vfCompositeLayerCC1 = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+            vfCompositeLayerCC2 = (sieve_word_t *)carveArray(pNext, nArrayBytes);
+            vCompactMultipliers = (CCompactMultipliers *)carveArray(pNext, GetArenaBytes(nCompactBytes));
+            vCunningham1Multipliers = (unsigned int *)carveArray(pNext, GetArenaBytes(nMultiplierBytes));
+            vCunningham2Multipliers = (unsigned int *)carveArray(pNext, GetArenaBytes(nMultiplierBytes));
         }
 
-        // Initialize arrays
-        memset(vfCandidates, 0, nCandidatesBytes);
-        memset(vfCompositeBiTwin, 0, nCandidatesBytes);
-        memset(vfCompositeCunningham1, 0, nCandidatesBytes);
-        memset(vfCompositeCunningham2, 0, nCandidatesBytes);
-        memset(vfCompositeLayerCC1, 0, nCandidatesBytes);
-        memset(vfCompositeLayerCC2, 0, nCandidatesBytes);
-        memset(vfExtendedCandidates, 0, nSieveExtensions * nCandidatesBytes);
-        memset(vfExtendedCompositeBiTwin, 0, nSieveExtensions * nCandidatesBytes);
-        memset(vfExtendedCompositeCunningham1, 0, nSieveExtensions * nCandidatesBytes);
-        memset(vfExtendedCompositeCunningham2, 0, nSieveExtensions * nCandidatesBytes);
-        memset(vCunningham1Multipliers, 0xFF, nMultiplierBytes);
-        memset(vCunningham2Multipliers, 0xFF, nMultiplierBytes);
+        // The arrays are not cleared here. Every segment clears its part of
+        // the composite arrays before it is weaved, the layer and candidate
+        // arrays are overwritten and WeaveMultipliers writes every multiplier.
+
+        // Empty the buckets but keep the memory for the next round
+        vCunningham1Buckets.resize(nSegments * nSieveLayers);
+        vCunningham2Buckets.resize(nSegments * nSieveLayers);
+        for (unsigned int i = 0; i < nSegments * nSieveLayers; i++)
+        {
+            vCunningham1Buckets[i].clear();
+            vCunningham2Buckets[i].clear();
+        }
 
         fIsReady = true;
         fIsDepleted = false;
     }
 
-    // Get total number of candidates for power test
-    unsigned int GetCandidateCount()
+    // Drain the candidates of the next segment or extension into vCandidates
+    //
+    // The candidates are scanned one segment at a time, first in the primary
+    // sieve and then in each extension, so that the scan can start as soon as
+    // the first segments have been weaved. The candidate words are scanned a
+    // whole word at a time and the chain type of every set bit is taken from
+    // the composite words of the same index, so testing the candidates
+    // doesn't need to go back to the sieve.
+    //
+    // Return values:
+    //   True - vCandidates has the candidates of the part, it is never empty
+    //   False - no candidates in vCandidates; the sieve is depleted or the
+    //           next segment has not been weaved yet
+    bool GetNextCandidates(std::vector<CSieveCandidate>& vCandidates)
     {
-        if (nCandidateCount)
-            return nCandidateCount;
+        vCandidates.clear();
+        if (fIsDepleted)
+            return false;
 
-        unsigned int nCandidates = 0;
-#ifdef USE_GCC_BUILTINS
-        for (unsigned int i = 0; i < nCandidatesWords; i++)
-            nCandidates += __builtin_popcountl(vfCandidates[i]);
-        for (unsigned int j = 0; j < nSieveExtensions; j++)
-            for (unsigned int i = nCandidatesWords / 2; i < nCandidatesWords; i++)
-                nCandidates += __builtin_popcountl(vfExtendedCandidates[j * nCandidatesWords + i]);
-#else
-        for (unsigned int i = 0; i < nCandidatesWords; i++)
+        loop
         {
-            sieve_word_t lBits = vfCandidates[i];
-            for (unsigned int j = 0; j < nWordBits; j++)
+            // Check whether the segment has been weaved
+            if (nCandidateSegment >= nCandidateSegmentsReady)
             {
-                nCandidates += (lBits & 1);
-                lBits >>= 1;
+                boost::mutex::scoped_lock lock(csSegments);
+                nCandidateSegmentsReady = nSegmentsDone;
+                if (nCandidateSegment >= nCandidateSegmentsReady)
+                    return false;
             }
-        }
-        for (unsigned int j = 0; j < nSieveExtensions; j++)
-        {
-            for (unsigned int i = nCandidatesWords / 2; i < nCandidatesWords; i++)
+
+            const unsigned int nSegmentEnd = std::min(nSegmentElements * (nCandidateSegment + 1), nSieveSize);
+            const sieve_word_t *vfActiveCandidates = fCandidateIsExtended ? GetExtendedArray(vfExtendedCandidates, nCandidateActiveExtension) : vfCandidates;
+            const sieve_word_t *vfActiveCompositeTWN = fCandidateIsExtended ? GetExtendedArray(vfExtendedCompositeBiTwin, nCandidateActiveExtension) : vfCompositeBiTwin;
+            const sieve_word_t *vfActiveCompositeCC1 = fCandidateIsExtended ? GetExtendedArray(vfExtendedCompositeCunningham1, nCandidateActiveExtension) : vfCompositeCunningham1;
+            const sieve_word_t *vfActiveCompositeCC2 = fCandidateIsExtended ? GetExtendedArray(vfExtendedCompositeCunningham2, nCandidateActiveExtension) : vfCompositeCunningham2;
+            const unsigned int nMultiplierShift = fCandidateIsExtended ? nCandidateActiveExtension + 1 : 0;
+
+            const unsigned int nMinWord = GetWordNum(nCandidateIndex);
+            const unsigned int nMaxWord = (nSegmentEnd + nWordBits - 1) / nWordBits;
+            for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
             {
-                sieve_word_t lBits = vfExtendedCandidates[j * nCandidatesWords + i];
-                for (unsigned int j = 0; j < nWordBits; j++)
+                sieve_word_t lBits = vfActiveCandidates[nWord * nArrayStride];
+                if (nWord == nMinWord)
+                    lBits &= ~(sieve_word_t)0 << (nCandidateIndex % nWordBits);
+                if (nWord == nMaxWord - 1 && nSegmentEnd % nWordBits)
+                    lBits &= ((sieve_word_t)1 << (nSegmentEnd % nWordBits)) - 1;
+                if (lBits == 0)
+                    continue;
+
+                const sieve_word_t lBiTwin = ~vfActiveCompositeTWN[nWord * nArrayStride];
+                const sieve_word_t lCunningham1 = ~vfActiveCompositeCC1[nWord * nArrayStride];
+                const sieve_word_t lCunningham2 = ~vfActiveCompositeCC2[nWord * nArrayStride];
+                do
                 {
-                    nCandidates += (lBits & 1);
-                    lBits >>= 1;
-                }
+                    const unsigned int nBit = CountTrailingZeros(lBits);
+                    const sieve_word_t lBitMask = (sieve_word_t)1 << nBit;
+                    lBits &= lBits - 1;
+
+                    CSieveCandidate candidate;
+                    candidate.nMultiplier = (uint64)(nWord * nWordBits + nBit) << nMultiplierShift;
+                    if (lBiTwin & lBitMask)
+                        candidate.nCandidateType = PRIME_CHAIN_BI_TWIN;
+                    else if (lCunningham1 & lBitMask)
+                        candidate.nCandidateType = PRIME_CHAIN_CUNNINGHAM1;
+                    else if (lCunningham2 & lBitMask)
+                        candidate.nCandidateType = PRIME_CHAIN_CUNNINGHAM2;
+                    else
+                        candidate.nCandidateType = 0; // unknown
+                    vCandidates.push_back(candidate);
+                } while (lBits);
             }
+            if (!NextCandidatePart() || !vCandidates.empty())
+                return !vCandidates.empty();
         }
-#endif
-        nCandidateCount = nCandidates;
-        return nCandidates;
     }
 
-    // Scan for the next candidate multiplier (variable part)
+    // Move the candidate scan to the next extension or segment
     // Return values:
-    //   True - found next candidate; nVariableMultiplier has the candidate
-    //   False - scan complete, no more candidate and reset scan
-    bool GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType)
+    //   True - nCandidateIndex is at the start of the next part
+    //   False - out of candidates, the sieve is depleted
+    bool NextCandidatePart()
     {
-        sieve_word_t *vfActiveCandidates;
-        sieve_word_t *vfActiveCompositeTWN;
-        sieve_word_t *vfActiveCompositeCC1;
-        sieve_word_t *vfActiveCompositeCC2;
-
-        if (fCandidateIsExtended)
+        // Continue with the next extension of the segment
+        if (!fCandidateIsExtended && nSieveExtensions > 0)
         {
-            vfActiveCandidates = vfExtendedCandidates + nCandidateActiveExtension * nCandidatesWords;
-            vfActiveCompositeTWN = vfExtendedCompositeBiTwin + nCandidateActiveExtension * nCandidatesWords;
-            vfActiveCompositeCC1 = vfExtendedCompositeCunningham1 + nCandidateActiveExtension * nCandidatesWords;
-            vfActiveCompositeCC2 = vfExtendedCompositeCunningham2 + nCandidateActiveExtension * nCandidatesWords;
+            fCandidateIsExtended = true;
+            nCandidateActiveExtension = 0;
         }
+        else if (fCandidateIsExtended && nCandidateActiveExtension + 1 < nSieveExtensions)
+            nCandidateActiveExtension++;
         else
         {
-            vfActiveCandidates = vfCandidates;
-            vfActiveCompositeTWN = vfCompositeBiTwin;
-            vfActiveCompositeCC1 = vfCompositeCunningham1;
-            vfActiveCompositeCC2 = vfCompositeCunningham2;
+            // Continue with the next segment
+            fCandidateIsExtended = false;
+            nCandidateActiveExtension = 0;
+            nCandidateSegment++;
+            if (nCandidateSegment >= nSegments)
+            {
+                // Out of candidates
+                fIsDepleted = true;
+                return false;
+            }
         }
 
-        // Acquire the current word from the bitmap
-        sieve_word_t lBits = vfActiveCandidates[GetWordNum(nCandidateIndex)];
+        // Only the second half of the extensions is used
+        nCandidateIndex = nSegmentElements * nCandidateSegment;
+        if (fCandidateIsExtended)
+            nCandidateIndex = std::max(nCandidateIndex, nSieveSize / 2);
+        return true;
+    }
 
-        loop
-        {
-            nCandidateIndex++;
-            if (nCandidateIndex >= nSieveSize)
-            {
-                // Check if extensions are available
-                if (!fCandidateIsExtended && nSieveExtensions > 0)
-                {
-                    fCandidateIsExtended = true;
-                    nCandidateActiveExtension = 0;
-                    nCandidateIndex = nSieveSize / 2;
-                }
-                else if (fCandidateIsExtended && nCandidateActiveExtension + 1 < nSieveExtensions)
-                {
-                    nCandidateActiveExtension++;
-                    nCandidateIndex = nSieveSize / 2;
-                }
-                else
-                {
-                    // Out of candidates
-                    fCandidateIsExtended = false;
-                    nCandidateActiveExtension = 0;
-                    nCandidateIndex = 0;
-                    nCandidateMultiplier = 0;
-                    fIsDepleted = true;
-                    return false;
-                }
+    // Find the first multiplier divisible by each prime for every layer
+    // Return values:
+    //   True  - multipliers ready for weaving the segments
+    //   False - interrupted by new work
+    bool WeaveMultipliers(ThreadWorkManager &wmanager);
 
-                // Fix the pointers
-                if (fCandidateIsExtended)
-                {
-                    vfActiveCandidates = vfExtendedCandidates + nCandidateActiveExtension * nCandidatesWords;
-                    vfActiveCompositeTWN = vfExtendedCompositeBiTwin + nCandidateActiveExtension * nCandidatesWords;
-                    vfActiveCompositeCC1 = vfExtendedCompositeCunningham1 + nCandidateActiveExtension * nCandidatesWords;
-                    vfActiveCompositeCC2 = vfExtendedCompositeCunningham2 + nCandidateActiveExtension * nCandidatesWords;
-                }
-                else
-                {
-                    vfActiveCandidates = vfCandidates;
-                    vfActiveCompositeTWN = vfCompositeBiTwin;
-                    vfActiveCompositeCC1 = vfCompositeCunningham1;
-                    vfActiveCompositeCC2 = vfCompositeCunningham2;
-                }
-
-                // Update the current word
-                lBits = vfActiveCandidates[GetWordNum(nCandidateIndex)];
-            }
+    // Weave a single L1 cache sized segment of the sieve
+    // pwmanager: optional work manager checked for new work between layers
+    // Return values:
+    //   True  - segment completed
+    //   False - interrupted by new work
+    bool WeaveSegment(ThreadWorkManager *pwmanager, unsigned int nSegment);
 
-            if (nCandidateIndex % nWordBits == 0)
-            {
-                // Update the current word
-                lBits = vfActiveCandidates[GetWordNum(nCandidateIndex)];
+    // Claim, weave and complete the next segment
+    // pwmanager: optional work manager checked for new work between layers
+    // Return values:
+    //   True  - segment completed
+    //   False - all segments have been claimed or interrupted by new work
+    bool WeaveNextSegment(ThreadWorkManager *pwmanager);
 
-                // Check if any bits are set
-                if (lBits == 0)
-                {
-                    // Skip an entire word
-                    nCandidateIndex += nWordBits - 1;
-                    continue;
-                }
-            }
+    // Allow the segments to be weaved by several threads at once
+    // The multiplier arrays are then left untouched by WeaveSegment
+    void SetSharedWeave(bool fShared) { fSharedWeave = fShared; }
 
-            if (lBits & GetBitMask(nCandidateIndex))
-            {
-                if (fCandidateIsExtended)
-                    nCandidateMultiplier = nCandidateIndex * (2 << nCandidateActiveExtension);
-                else
-                    nCandidateMultiplier = nCandidateIndex;
-                nVariableMultiplier = nCandidateMultiplier;
-                if (~vfActiveCompositeTWN[GetWordNum(nCandidateIndex)] & GetBitMask(nCandidateIndex))
-                    nCandidateType = PRIME_CHAIN_BI_TWIN;
-                else if (~vfActiveCompositeCC1[GetWordNum(nCandidateIndex)] & GetBitMask(nCandidateIndex))
-                    nCandidateType = PRIME_CHAIN_CUNNINGHAM1;
-                else if (~vfActiveCompositeCC2[GetWordNum(nCandidateIndex)] & GetBitMask(nCandidateIndex))
-                    nCandidateType = PRIME_CHAIN_CUNNINGHAM2;
-                else
-                    nCandidateType = 0; // unknown
-                return true;
-            }
-        }
+    // Claim the next segment to be weaved
+    // Return values:
+    //   True  - nSegment has the claimed segment
+    //   False - all segments have been claimed
+    bool ClaimSegment(unsigned int& nSegment)
+    {
+        if (nSegmentNext >= nSegments)
+            return false;
+#ifdef USE_GCC_BUILTINS
+        nSegment = __sync_fetch_and_add(&nSegmentNext, 1);
+#else
+        boost::mutex::scoped_lock lock(csSegments);
+        nSegment = nSegmentNext++;
+#endif
+        return nSegment < nSegments;
     }
 
-    // Get progress percentage of the sieve
-    unsigned int GetProgressPercentage();
+    // Mark a claimed segment as completed
+    // The candidate scan follows the leading completed segments
+    void CompleteSegment(unsigned int nSegment)
+    {
+        boost::mutex::scoped_lock lock(csSegments);
+        vfSegmentDone[nSegment] = true;
+        while (nSegmentsDone < nSegments && vfSegmentDone[nSegmentsDone])
+            nSegmentsDone++;
+    }
 
-    // Weave the sieve for the next prime in table
-    // Return values:
-    //   True  - weaved another prime; nComposite - number of composites removed
-    //   False - sieve already completed
-    bool Weave(ThreadWorkManager &wmanager);
+    // Get the chain length the sieve was weaved for
+    unsigned int GetChainLength() { return nChainLength; }
+
+    // Get the number of primes a chain position of a candidate was weaved with
+    // The candidates of extension i have the chain position nChainPosition
+    // in layer nChainPosition + i + 1
+    unsigned int GetLayerPrimes(uint64 nMultiplier, unsigned int nChainPosition)
+    {
+        unsigned int nLayerSeq = nChainPosition;
+        for (uint64 nMaxMultiplier = nSieveSize; nMultiplier >= nMaxMultiplier; nMaxMultiplier <<= 1)
+            nLayerSeq++;
+        return vLayerPrimes[nLayerSeq];
+    }
 
     bool IsReady() { return fIsReady; }
     bool IsDepleted() { return fIsDepleted; }
     void Deplete() { fIsDepleted = true; }
 };
 
+// Group of miner threads sharing a single sieve
+//
+// The leader of the group owns the work item and rebuilds the sieve. The
+// members draw the candidates to be tested from the shared sieve and weave
+// the next segment whenever the scan catches up with the weaved segments.
+// This reduces the time from new work to the first test and allows larger
+// sieves without increasing the latency of a block change.
+class CSieveGroup
+{
+public:
+    CSieveOfEratosthenes sieve;
+
+    CSieveGroup();
+    ~CSieveGroup();
+
+    // Leader: wait for the followers to leave the current sieve
+    void Retire();
+    // Leader: prepare the sieve for the work item and open it for the
+    // followers, the segments are weaved while the candidates are tested
+    // Return values:
+    //   True  - sieve open for the followers
+    //   False - interrupted by new work
+    bool Weave(ThreadWorkManager &wmanager, const WorkInfo& winfo);
+
+    // Follower: wait for a sieve newer than nGeneration and enter it
+    // Returns the generation of the sieve and a copy of its work item
+    unsigned int Join(unsigned int nGeneration, std::unique_ptr<WorkInfo>& spwinfo);
+    // Follower: leave the sieve entered with Join
+    void Leave();
+    // Follower: check whether the sieve still belongs to nGeneration
+    bool IsCurrent(unsigned int nGeneration) { return this->nGeneration == nGeneration; }
+    // Follower: work manager of the leader used for submitting chains
+    ThreadWorkManager *GetLeader() { return pleader; }
+
+    // Drain the candidates of the next part of the shared sieve
+    bool GetNextCandidates(std::vector<CSieveCandidate>& vCandidates)
+    {
+        boost::mutex::scoped_lock lock(csCandidates);
+        return sieve.GetNextCandidates(vCandidates);
+    }
+
+    // Check and set the depletion of the shared sieve
+    // The scan depletes the sieve under csCandidates, so the flag is only
+    // touched under the same lock while the group is working on it
+    bool IsDepleted()
+    {
+        boost::mutex::scoped_lock lock(csCandidates);
+        return sieve.IsDepleted();
+    }
+    void Deplete()
+    {
+        boost::mutex::scoped_lock lock(csCandidates);
+        sieve.Deplete();
+    }
+
+    // Follower: collect statistics for the leader
+    void AddStatistics(unsigned int nTests, unsigned int nPrimesHit, unsigned int nChainPrimeLength);
+    // Leader: move the statistics collected by the followers to winfo
+    void HarvestStatistics(WorkInfo& winfo, unsigned int vChainsFound[nMaxChainLength]);
+
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    boost::mutex csCandidates;
+    volatile unsigned int nGeneration; // incremented for each new sieve
+    bool fPublished; // sieve is open for the followers
+    unsigned int nBusy; // number of followers inside the sieve
+    std::unique_ptr<WorkInfo> spwinfo; // work item of the sieve
+    ThreadWorkManager *pleader;
+
+    // Statistics collected by the followers
+    volatile unsigned int nTests;
+    volatile unsigned int nPrimesHit;
+    volatile unsigned int vChainsFound[nMaxChainLength];
+};
+
 inline void mpz_set_uint256(mpz_t r, uint256& u)
 {
     mpz_import(r, 32 / sizeof(unsigned long), -1, sizeof(unsigned long), -1, 0, &u);
 }
 
+// r = a * n, also where unsigned long has only 32 bits
+inline void mpz_mul_uint64(mpz_class& r, const mpz_class& a, uint64 n)
+{
+    if (sizeof(unsigned long) >= sizeof(uint64) || (n >> 32) == 0)
+        mpz_mul_ui(r.get_mpz_t(), a.get_mpz_t(), (unsigned long)n);
+    else
+    {
+        mpz_class mpzN;
+        mpz_import(mpzN.get_mpz_t(), 1, -1, sizeof(n), 0, 0, &n);
+        r = a * mpzN;
+    }
+}
+
 #endif
 
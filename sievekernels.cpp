@@ -0,0 +1,331 @@
+#include "sievekernels.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#    define USE_SIMD_KERNELS
+#    include <immintrin.h>
+#    include "cpuid.h"
+#endif
+
+// nStride is 1 or SIEVE_INTERLEAVED_WORDS for the interleaved layout
+static void CombineLayerSetsStrided(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord, unsigned int nStride)
+{
+    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
+    {
+        const size_t nIndex = (size_t)nWord * nStride;
+        const sieve_word_t lLayerCC1 = vfLayerCC1[nWord];
+        const sieve_word_t lLayerCC2 = vfLayerCC2[nWord];
+        const sieve_word_t lLayerBoth = lLayerCC1 | lLayerCC2;
+        unsigned int i = 0;
+        for (; i < nBoth; i++)
+        {
+            vSets[i].vfCompositeCC1[nIndex] |= lLayerCC1;
+            vSets[i].vfCompositeCC2[nIndex] |= lLayerCC2;
+            vSets[i].vfCompositeTWN[nIndex] |= lLayerBoth;
+        }
+        for (; i < nBoth + nCC1; i++)
+        {
+            vSets[i].vfCompositeCC1[nIndex] |= lLayerCC1;
+            vSets[i].vfCompositeCC2[nIndex] |= lLayerCC2;
+            vSets[i].vfCompositeTWN[nIndex] |= lLayerCC1;
+        }
+        for (; i < nSets; i++)
+        {
+            vSets[i].vfCompositeCC1[nIndex] |= lLayerCC1;
+            vSets[i].vfCompositeCC2[nIndex] |= lLayerCC2;
+        }
+    }
+}
+
+static void CombineLayerSetsScalar(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    CombineLayerSetsStrided(vSets, nBoth, nCC1, nSets, vfLayerCC1, vfLayerCC2, nMinWord, nMaxWord, 1);
+}
+
+static void CombineCandidatesScalar(sieve_word_t *vfCandidates, const sieve_word_t *vfCompositeCC1, const sieve_word_t *vfCompositeCC2, const sieve_word_t *vfCompositeTWN, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
+        vfCandidates[nWord] = ~(vfCompositeCC1[nWord] & vfCompositeCC2[nWord] & vfCompositeTWN[nWord]);
+}
+
+// The sets point at the CC1, CC2 and BiTwin words of index 0
+void SieveCombineLayerSetsInterleaved(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    CombineLayerSetsStrided(vSets, nBoth, nCC1, nSets, vfLayerCC1, vfLayerCC2, nMinWord, nMaxWord, SIEVE_INTERLEAVED_WORDS);
+}
+
+void SieveCombineCandidatesInterleaved(sieve_word_t *vfWords, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    for (unsigned int nWord = nMinWord; nWord < nMaxWord; nWord++)
+    {
+        sieve_word_t *vfIndexWords = vfWords + nWord * SIEVE_INTERLEAVED_WORDS;
+        vfIndexWords[SIEVE_WORD_CANDIDATES] = ~(vfIndexWords[SIEVE_WORD_CC1] & vfIndexWords[SIEVE_WORD_CC2] & vfIndexWords[SIEVE_WORD_BITWIN]);
+    }
+}
+
+// Extended Euclidean algorithm to calculate the inverse of a in finite field defined by nPrime
+static unsigned int int_invert(unsigned int a, unsigned int nPrime)
+{
+    int rem0 = nPrime, rem1 = a % nPrime, rem2;
+    int aux0 = 0, aux1 = 1, aux2;
+    int quotient, inverse;
+
+    while (1)
+    {
+        if (rem1 <= 1)
+        {
+            inverse = aux1;
+            break;
+        }
+
+        rem2 = rem0 % rem1;
+        quotient = rem0 / rem1;
+        aux2 = -quotient * aux1 + aux0;
+
+        if (rem2 <= 1)
+        {
+            inverse = aux2;
+            break;
+        }
+
+        rem0 = rem1 % rem2;
+        quotient = rem1 / rem2;
+        aux0 = -quotient * aux2 + aux1;
+
+        if (rem0 <= 1)
+        {
+            inverse = aux0;
+            break;
+        }
+
+        rem1 = rem2 % rem0;
+        quotient = rem2 / rem0;
+        aux1 = -quotient * aux0 + aux2;
+    }
+
+    return (inverse + nPrime) % nPrime;
+}
+
+static void BatchInvertScalar(unsigned int *vInverses, const unsigned int *vResidues, const unsigned int *vModuli, unsigned int nCount)
+{
+    for (unsigned int i = 0; i < nCount; i++)
+        vInverses[i] = vResidues[i] ? int_invert(vResidues[i], vModuli[i]) : 0;
+}
+
+#ifdef USE_SIMD_KERNELS
+// Number of steps needed by the binary GCD for a batch of moduli
+//
+// The lanes keep u * v > 0 until u reaches 0 and every step at least halves
+// the product, which starts below the square of the modulus.
+static unsigned int BinaryInvertSteps(const unsigned int *vModuli, unsigned int nCount)
+{
+    unsigned int nMaxModulus = 0;
+    for (unsigned int i = 0; i < nCount; i++)
+        nMaxModulus = std::max(nMaxModulus, vModuli[i]);
+    unsigned int nBits = 0;
+    for (; nMaxModulus; nMaxModulus >>= 1)
+        nBits++;
+    return 2 * nBits;
+}
+
+// 256 bits (4 words) per set and step
+__attribute__((target("avx2")))
+static void CombineLayerSetsAVX2(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    unsigned int nWord = nMinWord;
+    for (; nWord + 4 <= nMaxWord; nWord += 4)
+    {
+        const __m256i vLayerCC1 = _mm256_loadu_si256((const __m256i *)(vfLayerCC1 + nWord));
+        const __m256i vLayerCC2 = _mm256_loadu_si256((const __m256i *)(vfLayerCC2 + nWord));
+        const __m256i vLayerBoth = _mm256_or_si256(vLayerCC1, vLayerCC2);
+        for (unsigned int i = 0; i < nSets; i++)
+        {
+            __m256i *pCC1 = (__m256i *)(vSets[i].vfCompositeCC1 + nWord);
+            __m256i *pCC2 = (__m256i *)(vSets[i].vfCompositeCC2 + nWord);
+            _mm256_storeu_si256(pCC1, _mm256_or_si256(_mm256_loadu_si256(pCC1), vLayerCC1));
+            _mm256_storeu_si256(pCC2, _mm256_or_si256(_mm256_loadu_si256(pCC2), vLayerCC2));
+            if (i < nBoth + nCC1)
+            {
+                __m256i *pTWN = (__m256i *)(vSets[i].vfCompositeTWN + nWord);
+                _mm256_storeu_si256(pTWN, _mm256_or_si256(_mm256_loadu_si256(pTWN), (i < nBoth) ? vLayerBoth : vLayerCC1));
+            }
+        }
+    }
+    CombineLayerSetsScalar(vSets, nBoth, nCC1, nSets, vfLayerCC1, vfLayerCC2, nWord, nMaxWord);
+}
+
+// 8 moduli per step
+//   x1 * a = u and x2 * a = v (mod p) with v odd
+//   u odd: swap u and v if u < v, u = u - v
+//   u even: u = u / 2
+__attribute__((target("avx2")))
+static void BatchInvertAVX2(unsigned int *vInverses, const unsigned int *vResidues, const unsigned int *vModuli, unsigned int nCount)
+{
+    const __m256i vZero = _mm256_setzero_si256();
+    const __m256i vOne = _mm256_set1_epi32(1);
+    unsigned int i = 0;
+    for (; i + 8 <= nCount; i += 8)
+    {
+        const __m256i vP = _mm256_loadu_si256((const __m256i *)(vModuli + i));
+        __m256i vU = _mm256_loadu_si256((const __m256i *)(vResidues + i));
+        __m256i vV = vP;
+        __m256i vX1 = vOne;
+        __m256i vX2 = vZero;
+        const unsigned int nSteps = BinaryInvertSteps(vModuli + i, 8);
+        for (unsigned int nStep = 0; nStep < nSteps; nStep++)
+        {
+            // Subtract the smaller odd value from the larger one
+            const __m256i vOdd = _mm256_cmpeq_epi32(_mm256_and_si256(vU, vOne), vOne);
+            const __m256i vSwap = _mm256_and_si256(vOdd, _mm256_cmpgt_epi32(vV, vU));
+            const __m256i vUS = _mm256_blendv_epi8(vU, vV, vSwap);
+            vV = _mm256_blendv_epi8(vV, vU, vSwap);
+            vU = vUS;
+            const __m256i vX1S = _mm256_blendv_epi8(vX1, vX2, vSwap);
+            vX2 = _mm256_blendv_epi8(vX2, vX1, vSwap);
+            vX1 = vX1S;
+            vU = _mm256_sub_epi32(vU, _mm256_and_si256(vV, vOdd));
+            vX1 = _mm256_sub_epi32(vX1, _mm256_and_si256(vX2, vOdd));
+            vX1 = _mm256_add_epi32(vX1, _mm256_and_si256(vP, _mm256_cmpgt_epi32(vZero, vX1)));
+
+            // Halve the even value
+            vU = _mm256_srli_epi32(vU, 1);
+            vX1 = _mm256_add_epi32(vX1, _mm256_and_si256(vP, _mm256_sub_epi32(vZero, _mm256_and_si256(vX1, vOne))));
+            vX1 = _mm256_srli_epi32(vX1, 1);
+        }
+        _mm256_storeu_si256((__m256i *)(vInverses + i), vX2);
+    }
+    BatchInvertScalar(vInverses + i, vResidues + i, vModuli + i, nCount - i);
+}
+
+__attribute__((target("avx2")))
+static void CombineCandidatesAVX2(sieve_word_t *vfCandidates, const sieve_word_t *vfCompositeCC1, const sieve_word_t *vfCompositeCC2, const sieve_word_t *vfCompositeTWN, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    const __m256i vOnes = _mm256_set1_epi64x(-1);
+    unsigned int nWord = nMinWord;
+    for (; nWord + 4 <= nMaxWord; nWord += 4)
+    {
+        __m256i vComposite = _mm256_loadu_si256((const __m256i *)(vfCompositeCC1 + nWord));
+        vComposite = _mm256_and_si256(vComposite, _mm256_loadu_si256((const __m256i *)(vfCompositeCC2 + nWord)));
+        vComposite = _mm256_and_si256(vComposite, _mm256_loadu_si256((const __m256i *)(vfCompositeTWN + nWord)));
+        _mm256_storeu_si256((__m256i *)(vfCandidates + nWord), _mm256_xor_si256(vComposite, vOnes));
+    }
+    CombineCandidatesScalar(vfCandidates, vfCompositeCC1, vfCompositeCC2, vfCompositeTWN, nWord, nMaxWord);
+}
+
+// 512 bits (8 words) per set and step
+__attribute__((target("avx512f")))
+static void CombineLayerSetsAVX512(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    unsigned int nWord = nMinWord;
+    for (; nWord + 8 <= nMaxWord; nWord += 8)
+    {
+        const __m512i vLayerCC1 = _mm512_loadu_si512((const void *)(vfLayerCC1 + nWord));
+        const __m512i vLayerCC2 = _mm512_loadu_si512((const void *)(vfLayerCC2 + nWord));
+        for (unsigned int i = 0; i < nSets; i++)
+        {
+            void *pCC1 = (void *)(vSets[i].vfCompositeCC1 + nWord);
+            void *pCC2 = (void *)(vSets[i].vfCompositeCC2 + nWord);
+            _mm512_storeu_si512(pCC1, _mm512_or_si512(_mm512_loadu_si512(pCC1), vLayerCC1));
+            _mm512_storeu_si512(pCC2, _mm512_or_si512(_mm512_loadu_si512(pCC2), vLayerCC2));
+            if (i < nBoth)
+            {
+                // TWN | CC1 | CC2
+                void *pTWN = (void *)(vSets[i].vfCompositeTWN + nWord);
+                _mm512_storeu_si512(pTWN, _mm512_ternarylogic_epi64(_mm512_loadu_si512(pTWN), vLayerCC1, vLayerCC2, 0xfe));
+            }
+            else if (i < nBoth + nCC1)
+            {
+                void *pTWN = (void *)(vSets[i].vfCompositeTWN + nWord);
+                _mm512_storeu_si512(pTWN, _mm512_or_si512(_mm512_loadu_si512(pTWN), vLayerCC1));
+            }
+        }
+    }
+    CombineLayerSetsScalar(vSets, nBoth, nCC1, nSets, vfLayerCC1, vfLayerCC2, nWord, nMaxWord);
+}
+
+// 16 moduli per step
+__attribute__((target("avx512f")))
+static void BatchInvertAVX512(unsigned int *vInverses, const unsigned int *vResidues, const unsigned int *vModuli, unsigned int nCount)
+{
+    const __m512i vOne = _mm512_set1_epi32(1);
+    const __mmask16 kAll = 0xFFFF;
+    unsigned int i = 0;
+    for (; i + 16 <= nCount; i += 16)
+    {
+        const __m512i vP = _mm512_loadu_si512((const void *)(vModuli + i));
+        __m512i vU = _mm512_loadu_si512((const void *)(vResidues + i));
+        __m512i vV = vP;
+        __m512i vX1 = vOne;
+        __m512i vX2 = _mm512_setzero_si512();
+        const unsigned int nSteps = BinaryInvertSteps(vModuli + i, 16);
+        for (unsigned int nStep = 0; nStep < nSteps; nStep++)
+        {
+            // Subtract the smaller odd value from the larger one
+            const __mmask16 kOdd = _mm512_test_epi32_mask(vU, vOne);
+            const __mmask16 kSwap = kOdd & _mm512_cmplt_epu32_mask(vU, vV);
+            const __m512i vUS = _mm512_mask_mov_epi32(vU, kSwap, vV);
+            vV = _mm512_mask_mov_epi32(vV, kSwap, vU);
+            vU = vUS;
+            const __m512i vX1S = _mm512_mask_mov_epi32(vX1, kSwap, vX2);
+            vX2 = _mm512_mask_mov_epi32(vX2, kSwap, vX1);
+            vX1 = vX1S;
+            const __mmask16 kBorrow = kOdd & _mm512_cmplt_epu32_mask(vX1, vX2);
+            vU = _mm512_mask_sub_epi32(vU, kOdd, vU, vV);
+            vX1 = _mm512_mask_sub_epi32(vX1, kOdd, vX1, vX2);
+            vX1 = _mm512_mask_add_epi32(vX1, kBorrow, vX1, vP);
+
+            // Halve the even value
+            // The zero masked shifts avoid the undefined source of
+            // _mm512_srli_epi32, which trips -Wmaybe-uninitialized on GCC 12
+            vU = _mm512_maskz_srli_epi32(kAll, vU, 1);
+            vX1 = _mm512_mask_add_epi32(vX1, _mm512_test_epi32_mask(vX1, vOne), vX1, vP);
+            vX1 = _mm512_maskz_srli_epi32(kAll, vX1, 1);
+        }
+        _mm512_storeu_si512((void *)(vInverses + i), vX2);
+    }
+    BatchInvertScalar(vInverses + i, vResidues + i, vModuli + i, nCount - i);
+}
+
+__attribute__((target("avx512f")))
+static void CombineCandidatesAVX512(sieve_word_t *vfCandidates, const sieve_word_t *vfCompositeCC1, const sieve_word_t *vfCompositeCC2, const sieve_word_t *vfCompositeTWN, unsigned int nMinWord, unsigned int nMaxWord)
+{
+    unsigned int nWord = nMinWord;
+    for (; nWord + 8 <= nMaxWord; nWord += 8)
+    {
+        // ~(CC1 & CC2 & TWN)
+        const __m512i vCompositeCC1 = _mm512_loadu_si512((const void *)(vfCompositeCC1 + nWord));
+        const __m512i vCompositeCC2 = _mm512_loadu_si512((const void *)(vfCompositeCC2 + nWord));
+        const __m512i vCompositeTWN = _mm512_loadu_si512((const void *)(vfCompositeTWN + nWord));
+        _mm512_storeu_si512((void *)(vfCandidates + nWord), _mm512_ternarylogic_epi64(vCompositeCC1, vCompositeCC2, vCompositeTWN, 0x7f));
+    }
+    CombineCandidatesScalar(vfCandidates, vfCompositeCC1, vfCompositeCC2, vfCompositeTWN, nWord, nMaxWord);
+}
+#endif
+
+CombineLayerSetsFunc SieveCombineLayerSets = CombineLayerSetsScalar;
+CombineCandidatesFunc SieveCombineCandidates = CombineCandidatesScalar;
+BatchInvertFunc BatchInvert = BatchInvertScalar;
+
+void SelectSieveKernels()
+{
+    const char *pszKernels = "scalar";
+    SieveCombineLayerSets = CombineLayerSetsScalar;
+    SieveCombineCandidates = CombineCandidatesScalar;
+    BatchInvert = BatchInvertScalar;
+#ifdef USE_SIMD_KERNELS
+    if (CPUID::HasAVX512F())
+    {
+        pszKernels = "AVX-512";
+        SieveCombineLayerSets = CombineLayerSetsAVX512;
+        SieveCombineCandidates = CombineCandidatesAVX512;
+        BatchInvert = BatchInvertAVX512;
+    }
+    else if (CPUID::HasAVX2())
+    {
+        pszKernels = "AVX2";
+        SieveCombineLayerSets = CombineLayerSetsAVX2;
+        SieveCombineCandidates = CombineCandidatesAVX2;
+        BatchInvert = BatchInvertAVX2;
+    }
+#endif
+    printf("SelectSieveKernels() : using %s sieve kernels\n", pszKernels);
+}
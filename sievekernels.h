@@ -0,0 +1,55 @@
+#pragma once
+#include "prime.h"
+
+// Kernels for the hot loops of the sieve
+//
+// Vector versions are selected at runtime depending on the CPU features with
+// the plain loops kept as a fallback. The combine kernels process the words
+// [nMinWord, nMaxWord) of the arrays.
+
+// How a layer contributes to the BiTwin composites
+enum
+{
+    LAYER_BITWIN_NONE = 0, // layer is beyond the BiTwin chain
+    LAYER_BITWIN_CC1  = 1, // vfCompositeBiTwin |= vfLayerCC1
+    LAYER_BITWIN_BOTH = 2, // vfCompositeBiTwin |= vfLayerCC1 | vfLayerCC2
+};
+
+// Composite arrays of the primary sieve or of an extension
+struct CCompositeSet
+{
+    sieve_word_t *vfCompositeCC1;
+    sieve_word_t *vfCompositeCC2;
+    sieve_word_t *vfCompositeTWN;
+};
+
+// Apply a layer to several sets of composite arrays in one pass
+// The first nBoth sets take the layer as LAYER_BITWIN_BOTH, the next nCC1
+// sets as LAYER_BITWIN_CC1 and the rest of the nSets sets as
+// LAYER_BITWIN_NONE. Every word of the layer is loaded once and kept in
+// registers while it is applied to all the sets.
+typedef void (*CombineLayerSetsFunc)(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord);
+
+// Combine the composite arrays into candidates
+//   vfCandidates = ~(vfCompositeCC1 & vfCompositeCC2 & vfCompositeTWN)
+typedef void (*CombineCandidatesFunc)(sieve_word_t *vfCandidates, const sieve_word_t *vfCompositeCC1, const sieve_word_t *vfCompositeCC2, const sieve_word_t *vfCompositeTWN, unsigned int nMinWord, unsigned int nMaxWord);
+
+// Invert a batch of residues modulo odd primes
+//   vInverses[i] = vResidues[i]^-1 mod vModuli[i], or 0 if vResidues[i] is 0
+// The residues must be reduced and vInverses may be the same as vResidues.
+// The vector versions run a division free binary extended GCD on a lane per
+// modulus.
+typedef void (*BatchInvertFunc)(unsigned int *vInverses, const unsigned int *vResidues, const unsigned int *vModuli, unsigned int nCount);
+
+// Versions of the combine kernels for the interleaved layout
+// vfWords points at the candidates word of index 0 and the words of each index
+// are laid out as given by SIEVE_WORD_*.
+void SieveCombineLayerSetsInterleaved(const CCompositeSet *vSets, unsigned int nBoth, unsigned int nCC1, unsigned int nSets, const sieve_word_t *vfLayerCC1, const sieve_word_t *vfLayerCC2, unsigned int nMinWord, unsigned int nMaxWord);
+void SieveCombineCandidatesInterleaved(sieve_word_t *vfWords, unsigned int nMinWord, unsigned int nMaxWord);
+
+extern CombineLayerSetsFunc SieveCombineLayerSets;
+extern CombineCandidatesFunc SieveCombineCandidates;
+extern BatchInvertFunc BatchInvert;
+
+// Select the fastest kernels supported by the CPU
+void SelectSieveKernels();
@@ -1,6 +1,7 @@
 #include "workmanager.h"
 #include "protocol.h"
 #include "sync.h"
+#include "numa.h"
 #include <immintrin.h>
 
 #undef printf
@@ -59,6 +60,9 @@ void ThreadWorkManager::ThreadEntry()
 	{
 	SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
+	// Bind to the NUMA node before the miner allocates its state
+	BindThreadToNumaNode(GetThreadNumaNode(m_thread));
+
 	// The wait loop below is to ensure we don't declare the thread as alive until it has its first work item
 	while(m_fWaitForWork.test_and_set(boost::memory_order_acquire))
 		{
@@ -79,6 +83,7 @@ void WorkManager::SpinupThreads(unsigned cthreads)
     }
 
 	printf("Starting (%u) threads.\n", cthreads);
+	InitNuma(cthreads);
 
     m_spminerThreads = std::unique_ptr<boost::thread_group>(new boost::thread_group());
     for (unsigned i = 0; i < cthreads; i++)